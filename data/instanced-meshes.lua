@@ -0,0 +1,46 @@
+--
+-- One mesh shared by many transforms
+--
+octahedron = trimesh{
+    vertices={{x=0.0, y=0.5, z=0.0},
+              {x=0.5, y=0.0, z=0.0},
+              {x=0.0, y=0.0, z=0.5},
+              {x=-0.5, y=0.0, z=0.0},
+              {x=0.0, y=0.0, z=-0.5},
+              {x=0.0, y=-0.5, z=0.0}},
+    faces={{i=0, j=2, k=1},
+           {i=0, j=3, k=2},
+           {i=0, j=4, k=3},
+           {i=0, j=1, k=4},
+           {i=5, j=1, k=2},
+           {i=5, j=2, k=3},
+           {i=5, j=3, k=4},
+           {i=5, j=4, k=1}},
+    material=lambertian{r=0.7, g=0.6, b=0.2, reflectivity=0.5}
+}
+
+children = {}
+children[1] = sphere{
+    centre={x=0, y=-1000, z=0},
+    radius=1000.0,
+    material=lambertian{r=0.5, g=0.5, b=0.5, reflectivity=0.5}
+}
+
+i = 2
+for a=-11,11 do
+    for b=-11,11 do
+        children[i] = transform{
+            translation={x=a, y=0.5, z=b},
+            rotation={quat{angle=math.random()*math.pi, x=0.0, y=1.0, z=0.0}},
+            child=octahedron
+        }
+        i = i + 1
+    end
+end
+
+scene {
+    r=0.5,
+    g=0.5,
+    b=0.5,
+    children=children
+}
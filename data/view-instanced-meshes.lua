@@ -0,0 +1,17 @@
+eyepoint {
+    pos={x=3.0, y=3.0, z=-7.0},
+    dir={x=0.0, y=0.0, z=1.0},
+    up={x=0.0, y=1.0, z=0.0},
+}
+
+image {
+    height=256,
+    width=256,
+}
+
+surface {
+    u0=-1.0,
+    v0=-1.0,
+    u1=1.0,
+    v1=1.0,
+}
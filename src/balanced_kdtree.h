@@ -0,0 +1,759 @@
+/*
+Copyright (c) 2018 Daniel Minor
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#ifndef BALANCED_KD_TREE_H_
+#define BALANCED_KD_TREE_H_
+
+#include <cmath>
+
+#include <algorithm>
+#include <atomic>
+#include <limits>
+#include <memory>
+#include <thread>
+#include <utility>
+#include <vector>
+
+/*
+A left balanced kd-tree stored as an implicit heap, after Jensen. The points
+themselves are the nodes, reordered in place so that node i is pts[i - 1] and
+its children are nodes 2i and 2i + 1. There are no node structures or
+pointers, so the tree costs no memory beyond the points.
+
+The split axis of each node is kept in the point, which must provide
+get_axis() and set_axis(int) using spare bits, along with operator[] for
+its coordinates.
+*/
+template<class Point, class Number> class BalancedKdTree {
+
+public:
+
+    //a point found by a query and its squared distance from the query point
+    struct Neighbour {
+        Point *pt;
+        Number distance;
+    };
+
+    //working space for queries. Each thread querying the tree needs its
+    //own, it is reused between queries so that they do not allocate.
+    struct Scratch {
+        //nodes still to be searched and the squared distance from the
+        //query point to their parent's splitting plane
+        std::vector<std::pair<size_t, Number> > stack;
+    };
+
+    //queries made together by knn_packet, bit i of a mask refers to
+    //query i
+    static const size_t PACKET_SIZE = 8;
+
+    //distances to candidate neighbours are computed VECTOR_SIZE at a time
+    //with GCC vector extensions
+    static const size_t VECTOR_SIZE = 8;
+    typedef Number Vector __attribute__((vector_size(VECTOR_SIZE*sizeof(Number))));
+
+    //working space for packet queries, as for Scratch
+    struct PacketScratch {
+        Scratch scratch;
+
+        //the points which may be neighbours of any query in the packet, and
+        //their coordinates in structure of arrays form. Block b*dim + j holds
+        //coordinate j of candidates [b*VECTOR_SIZE, (b + 1)*VECTOR_SIZE),
+        //wrapped as GCC drops the vector attribute from a template argument.
+        struct Block {
+            Vector coord;
+        };
+
+        std::vector<Point *> candidates;
+        std::vector<Block> blocks;
+        std::vector<Neighbour> neighbours;
+    };
+
+    /** Builds a kd-tree over the points, reordering them in place.
+
+        \param dim The number of dimensions.
+        \param pts The points.
+        \param n The number of points.
+        \param nthreads The number of threads used to build the tree, the
+                        layout does not depend on this.
+    */
+    BalancedKdTree(size_t dim, Point *pts, size_t n, size_t nthreads = 1)
+        : n(n)
+        , dim(dim)
+        , points(pts)
+    {
+        //points are selected from a copy and placed at their heap index,
+        //large ranges are partitioned through scratch
+        std::unique_ptr<Point[]> work(new Point[n]);
+        std::copy(pts, pts + n, work.get());
+        std::unique_ptr<Point[]> scratch;
+        if (n >= PARALLEL_PARTITION_MIN) scratch.reset(new Point[n]);
+        build(work.get(), scratch.get(), n, 1, nthreads ? nthreads : 1);
+    }
+
+    //selects the constructor which uses points already in heap order
+    struct Prebuilt {
+    };
+
+    /** Uses points already in heap order, such as points mapped from a
+        file after an earlier build. The points are not copied and must
+        outlive the tree.
+
+        \param dim The number of dimensions.
+        \param pts The points, in the order left by the build.
+        \param n The number of points.
+    */
+    BalancedKdTree(size_t dim, Point *pts, size_t n, Prebuilt)
+        : n(n)
+        , dim(dim)
+        , points(pts)
+    {
+    }
+
+    size_t size() const
+    {
+        return n;
+    }
+
+    /** This function searches for the k nearest neighbours to a query point
+        without modifying the tree, so it may be called from several threads
+        at once provided each has its own scratch space.
+
+        \param pt The point for which to find the nearest neighbours.
+        \param k The number of nearest neighbours to find.
+        \param eps The epsilon for approximate nearest neighbour searches.
+        \param scratch Working space for the search.
+        \param result Space for k neighbours, receives the neighbours found
+                      ordered from nearest to farthest.
+        \return The number of neighbours found, less than k only if the tree
+                has fewer than k points.
+    */
+    size_t knn(const Point &pt, size_t k, Number eps, Scratch &scratch,
+        Neighbour *result) const
+    {
+        return knn(pt, k, std::numeric_limits<Number>::infinity(), eps,
+            scratch, result);
+    }
+
+    /** This function searches for the k nearest neighbours to a query point
+        which are within a radius of it, as knn() above.
+
+        \param pt The point for which to find the nearest neighbours.
+        \param k The number of nearest neighbours to find.
+        \param radius Neighbours farther than this from pt are not found.
+        \param eps The epsilon for approximate nearest neighbour searches.
+        \param scratch Working space for the search.
+        \param result Space for k neighbours, receives the neighbours found
+                      ordered from nearest to farthest.
+        \return The number of neighbours found, less than k if there are
+                fewer than k points within the radius.
+    */
+    size_t knn(const Point &pt, size_t k, Number radius, Number eps,
+        Scratch &scratch, Neighbour *result) const
+    {
+        if (!k || !n) return 0;
+
+        //result is a max heap on distance until the search is complete, so
+        //the farthest neighbour found so far is result[0]. Points on the
+        //radius are found, so a branch is only skipped if it is beyond the
+        //radius or no closer than result[0] once there are k neighbours.
+        size_t count = 0;
+        Number scale = (1.0 + eps)*(1.0 + eps);
+        Number radius2 = radius*radius;
+        auto prune = [&](Number plane_distance) {
+            return plane_distance > radius2
+                || (count == k && plane_distance >= result[0].distance);
+        };
+        scratch.stack.clear();
+        scratch.stack.push_back(std::make_pair((size_t)1, (Number)0));
+
+        while (!scratch.stack.empty()) {
+            size_t i = scratch.stack.back().first;
+            Number plane_distance = scratch.stack.back().second;
+            scratch.stack.pop_back();
+
+            if (prune(plane_distance*scale)) continue;
+
+            while (i <= n) {
+                Point *node = &points[i - 1];
+                Number distance = 0;
+                for (size_t j = 0; j < dim; ++j) {
+                    Number d = (*node)[j] - pt[j];
+                    distance += d*d;
+                }
+
+                if (distance > radius2) {
+                    //outside the radius
+                } else if (count < k) {
+                    result[count].pt = node;
+                    result[count].distance = distance;
+                    sift_up(result, count++);
+                } else if (distance < result[0].distance) {
+                    result[0].pt = node;
+                    result[0].distance = distance;
+                    sift_down(result, 0, count);
+                }
+
+                //continue down the near side, the far side is searched later
+                //if it could still hold a closer point
+                int axis = node->get_axis();
+                Number d = pt[axis] - (*node)[axis];
+                size_t near = d < 0 ? 2*i : 2*i + 1;
+                size_t far = d < 0 ? 2*i + 1 : 2*i;
+                if (far <= n && !prune(d*d*scale)) {
+                    scratch.stack.push_back(std::make_pair(far, d*d));
+                }
+
+                i = near;
+            }
+        }
+
+        //sort the heap from nearest to farthest
+        for (size_t m = count; m > 1; --m) {
+            std::swap(result[0], result[m - 1]);
+            sift_down(result, 0, m - 1);
+        }
+
+        return count;
+    }
+
+    /** This function searches for the k nearest neighbours of a packet of
+        query points. The tree is searched once around the centre of the
+        packet for every point which could be a neighbour of one of the
+        queries, then each query's distances to those candidates are
+        computed several at a time. This is much cheaper than separate
+        queries when the queries are close together, such as the hits of a
+        packet of camera rays, packets which are spread out fall back to
+        separate queries.
+
+        \param pts The query points, PACKET_SIZE of them.
+        \param active Mask of the queries to make.
+        \param k The number of nearest neighbours to find for each query.
+        \param eps The epsilon for approximate nearest neighbour searches,
+                   only the search around the centre is approximate.
+        \param scratch Working space for the search.
+        \param result Space for k neighbours per query, query i receives its
+                      neighbours from result[i*k] ordered from nearest to
+                      farthest.
+        \param counts Receives the number of neighbours found for each query,
+                      0 for inactive queries.
+    */
+    void knn_packet(const Point *pts, unsigned active, size_t k, Number eps,
+        PacketScratch &scratch, Neighbour *result, size_t *counts) const
+    {
+        for (size_t i = 0; i < PACKET_SIZE; ++i) counts[i] = 0;
+        if (!k || !n || !active) return;
+
+        //centre of the packet and the distance to the farthest query from it
+        Point centre = pts[__builtin_ctz(active)];
+        size_t nactive = 0;
+        for (size_t j = 0; j < dim; ++j) centre[j] = 0;
+        for (size_t i = 0; i < PACKET_SIZE; ++i) {
+            if (!(active & (1u << i))) continue;
+            for (size_t j = 0; j < dim; ++j) centre[j] += pts[i][j];
+            ++nactive;
+        }
+        for (size_t j = 0; j < dim; ++j) centre[j] /= nactive;
+
+        Number spread = 0;
+        for (size_t i = 0; i < PACKET_SIZE; ++i) {
+            if (active & (1u << i)) {
+                spread = std::max(spread, distance(pts[i], centre));
+            }
+        }
+        spread = sqrt(spread);
+
+        //the k nearest neighbours of the centre are within reach + spread of
+        //every query, so each query's neighbours are within reach + 2*spread
+        //of the centre
+        scratch.neighbours.resize(std::max(k, scratch.neighbours.size()));
+        size_t found = knn(centre, k, eps, scratch.scratch,
+            &scratch.neighbours[0]);
+        Number reach = sqrt(scratch.neighbours[found - 1].distance);
+
+        auto separate = [&]() {
+            for (size_t i = 0; i < PACKET_SIZE; ++i) {
+                if (active & (1u << i)) {
+                    counts[i] = knn(pts[i], k, eps, scratch.scratch,
+                        result + i*k);
+                }
+            }
+        };
+
+        if (nactive == 1 || (found == k && spread > reach)) {
+            separate();
+            return;
+        }
+
+        //the bound is never below the squared distance already found and
+        //has some slack, so rounding cannot drop the farthest neighbour of
+        //the centre when the queries coincide
+        Number radius2 = std::numeric_limits<Number>::infinity();
+        if (found == k) {
+            Number radius = reach + 2*spread;
+            radius2 = std::max(radius*radius, scratch.neighbours[found - 1].distance)
+                *(1 + 16*std::numeric_limits<Number>::epsilon());
+        }
+        gather(centre, radius2, scratch);
+
+        //should rounding still leave too few candidates, the queries are
+        //made separately
+        size_t m = scratch.candidates.size();
+        if (m < found) {
+            separate();
+            return;
+        }
+        size_t nblocks = (m + VECTOR_SIZE - 1)/VECTOR_SIZE;
+        scratch.neighbours.resize(std::max(m, scratch.neighbours.size()));
+        for (size_t i = 0; i < PACKET_SIZE; ++i) {
+            if (!(active & (1u << i))) continue;
+
+            Neighbour *neighbours = &scratch.neighbours[0];
+            for (size_t block = 0; block < nblocks; ++block) {
+                Vector distance = {};
+                for (size_t j = 0; j < dim; ++j) {
+                    Vector d = scratch.blocks[block*dim + j].coord - pts[i][j];
+                    distance += d*d;
+                }
+
+                size_t first = block*VECTOR_SIZE;
+                //copied, std::min would bind a reference to the constant,
+                //which has no definition
+                size_t count = std::min(m - first, (size_t)VECTOR_SIZE);
+                for (size_t c = 0; c < count; ++c) {
+                    neighbours[first + c].pt = scratch.candidates[first + c];
+                    neighbours[first + c].distance = distance[c];
+                }
+            }
+
+            auto nearer = [](const Neighbour &a, const Neighbour &b) {
+                return a.distance < b.distance;
+            };
+            size_t count = std::min(k, m);
+            std::nth_element(neighbours, neighbours + count - 1,
+                neighbours + m, nearer);
+            std::sort(neighbours, neighbours + count - 1, nearer);
+            std::copy(neighbours, neighbours + count, result + i*k);
+            counts[i] = count;
+        }
+    }
+
+    /** This function finds every point within a radius of a query point
+        without modifying the tree.
+
+        \param pt The query point.
+        \param radius The radius to search, points on it are found.
+        \param scratch Working space for the search.
+        \param fn Called as fn(Point *, Number) for each point found, with
+                  its squared distance from pt, in no particular order.
+        \return The number of points found.
+    */
+    template<class Fn> size_t range(const Point &pt, Number radius,
+        Scratch &scratch, Fn fn) const
+    {
+        return gather(pt, radius*radius, scratch, fn);
+    }
+
+    /** This function searches for a single exact nearest neighbour.
+
+        \param pt The point for which to find the nearest neighbour.
+        \return The nearest point, or null if the tree is empty.
+    */
+    Point *nn(const Point &pt) const
+    {
+        Scratch scratch;
+        Neighbour result;
+        return knn(pt, 1, 0, scratch, &result) ? result.pt : 0;
+    }
+
+    /** This function searches for the node whose region contains a query
+        point, descending by the split at each node until there is no child
+        on the query point's side.
+
+        \param pt The point for which to locate the node.
+        \return The point stored at that node, or null if the tree is empty.
+    */
+    Point *locate(const Point &pt) const
+    {
+        if (!n) return 0;
+
+        size_t i = 1;
+        while (2*i <= n) {
+            const Point &node = points[i - 1];
+            int axis = node.get_axis();
+            size_t next = pt[axis] < node[axis] ? 2*i : 2*i + 1;
+            if (next > n) break;
+            i = next;
+        }
+
+        return &points[i - 1];
+    }
+
+private:
+
+    size_t n;
+    size_t dim;
+
+    Point *points;
+
+    //subtrees with at least this many points are built on a separate thread
+    //when there are threads to spare
+    static const size_t PARALLEL_BUILD_MIN = 1 << 12;
+
+    //ranges with at least this many points have their extent found and
+    //their median selected in blocks of PARTITION_BLOCK points spread over
+    //the threads. This does not depend on the thread count, so neither does
+    //the layout
+    static const size_t PARALLEL_PARTITION_MIN = 1 << 18;
+    static const size_t PARTITION_BLOCK = 1 << 14;
+
+    //the number of nodes in the left subtree of a left balanced tree of
+    //count nodes, every level is full apart from the last which is filled
+    //from the left
+    static size_t left_count(size_t count)
+    {
+        if (count < 2) return 0;
+
+        size_t full = 1;
+        while (full*2 <= count) full *= 2;
+
+        //the last level has room for full nodes, the full - 1 nodes above
+        //it are split evenly and the left subtree takes up to half of it
+        size_t half = full/2;
+        return half - 1 + std::min(count - (full - 1), half);
+    }
+
+    //places the median of work on the axis of greatest extent at node i,
+    //then builds the subtrees from the points either side of it. scratch
+    //is as large as work if it may be partitioned in blocks
+    void build(Point *work, Point *scratch, size_t count, size_t i,
+        size_t nthreads)
+    {
+        if (!count) return;
+
+        bool blocks = count >= PARALLEL_PARTITION_MIN;
+        int axis = blocks ? widest_axis_blocks(work, count, nthreads)
+            : widest_axis(work, count);
+
+        size_t median = left_count(count);
+        if (blocks) {
+            select_blocks(work, scratch, count, median, axis, nthreads);
+        } else {
+            std::nth_element(work, work + median, work + count,
+                [axis](const Point &a, const Point &b) {
+                    return a[axis] < b[axis];
+                });
+        }
+
+        points[i - 1] = work[median];
+        points[i - 1].set_axis(axis);
+
+        //subtrees write disjoint parts of work, scratch and points
+        Point *right = work + median + 1;
+        Point *right_scratch = blocks ? scratch + median + 1 : nullptr;
+        size_t right_count = count - median - 1;
+        if (nthreads > 1 && count >= PARALLEL_BUILD_MIN) {
+            size_t left_threads = nthreads/2;
+            std::thread thread([&] {
+                build(work, scratch, median, 2*i, left_threads);
+            });
+            build(right, right_scratch, right_count, 2*i + 1,
+                nthreads - left_threads);
+            thread.join();
+        } else {
+            build(work, scratch, median, 2*i, 1);
+            build(right, right_scratch, right_count, 2*i + 1, 1);
+        }
+    }
+
+    int widest_axis(const Point *work, size_t count) const
+    {
+        int axis = 0;
+        Number extent = -1;
+        for (size_t j = 0; count > 1 && j < dim; ++j) {
+            Number lo = work[0][j];
+            Number hi = work[0][j];
+            for (size_t m = 1; m < count; ++m) {
+                lo = std::min(lo, work[m][j]);
+                hi = std::max(hi, work[m][j]);
+            }
+            if (hi - lo > extent) {
+                extent = hi - lo;
+                axis = j;
+            }
+        }
+
+        return axis;
+    }
+
+    //as widest_axis, each block finds its own bounds
+    int widest_axis_blocks(const Point *work, size_t count, size_t nthreads) const
+    {
+        size_t nblocks = (count + PARTITION_BLOCK - 1)/PARTITION_BLOCK;
+        std::vector<Number> lo(nblocks*dim), hi(nblocks*dim);
+        parallel_for(nblocks, nthreads, [&](size_t block) {
+            size_t first = block*PARTITION_BLOCK;
+            size_t last = std::min(first + PARTITION_BLOCK, count);
+            for (size_t j = 0; j < dim; ++j) {
+                Number l = work[first][j];
+                Number h = work[first][j];
+                for (size_t m = first + 1; m < last; ++m) {
+                    l = std::min(l, work[m][j]);
+                    h = std::max(h, work[m][j]);
+                }
+                lo[block*dim + j] = l;
+                hi[block*dim + j] = h;
+            }
+        });
+
+        int axis = 0;
+        Number extent = -1;
+        for (size_t j = 0; j < dim; ++j) {
+            Number l = lo[j];
+            Number h = hi[j];
+            for (size_t block = 1; block < nblocks; ++block) {
+                l = std::min(l, lo[block*dim + j]);
+                h = std::max(h, hi[block*dim + j]);
+            }
+            if (h - l > extent) {
+                extent = h - l;
+                axis = j;
+            }
+        }
+
+        return axis;
+    }
+
+    //moves the point which belongs at work[k] on the axis there, with
+    //smaller points before it and larger points after, as nth_element does.
+    //Large ranges are split three ways around a pivot in blocks, once the
+    //range holding k is small nth_element finishes it
+    void select_blocks(Point *work, Point *scratch, size_t count, size_t k,
+        int axis, size_t nthreads)
+    {
+        size_t start = 0;
+        size_t end = count;
+        while (end - start >= PARALLEL_PARTITION_MIN) {
+            //median of three, equal points end up together so ranges of
+            //duplicates do not stall the search
+            Number a = work[start][axis];
+            Number b = work[start + (end - start)/2][axis];
+            Number c = work[end - 1][axis];
+            Number pivot = std::max(std::min(a, b), std::min(std::max(a, b), c));
+
+            size_t nless, nequal;
+            partition_blocks(work + start, scratch + start, end - start, axis,
+                pivot, nthreads, nless, nequal);
+            if (k < start + nless) {
+                end = start + nless;
+            } else if (k < start + nless + nequal) {
+                return;
+            } else {
+                start += nless + nequal;
+            }
+        }
+
+        std::nth_element(work + start, work + k, work + end,
+            [axis](const Point &a, const Point &b) {
+                return a[axis] < b[axis];
+            });
+    }
+
+    //reorders pts into points less than, equal to then greater than the
+    //pivot, keeping the order of each block so the result does not depend
+    //on the thread count
+    void partition_blocks(Point *pts, Point *scratch, size_t count, int axis,
+        Number pivot, size_t nthreads, size_t &nless, size_t &nequal) const
+    {
+        size_t nblocks = (count + PARTITION_BLOCK - 1)/PARTITION_BLOCK;
+        auto block_end = [&](size_t block) {
+            return std::min((block + 1)*PARTITION_BLOCK, count);
+        };
+
+        std::vector<size_t> less(nblocks), equal(nblocks);
+        parallel_for(nblocks, nthreads, [&](size_t block) {
+            size_t l = 0;
+            size_t e = 0;
+            for (size_t j = block*PARTITION_BLOCK; j < block_end(block); ++j) {
+                l += pts[j][axis] < pivot;
+                e += pts[j][axis] == pivot;
+            }
+            less[block] = l;
+            equal[block] = e;
+        });
+
+        //where each block's points go in scratch
+        nless = 0;
+        nequal = 0;
+        for (size_t block = 0; block < nblocks; ++block) {
+            nless += less[block];
+            nequal += equal[block];
+        }
+
+        std::vector<size_t> less_offset(nblocks), equal_offset(nblocks),
+            greater_offset(nblocks);
+        size_t lt = 0;
+        size_t eq = nless;
+        size_t gt = nless + nequal;
+        for (size_t block = 0; block < nblocks; ++block) {
+            less_offset[block] = lt;
+            equal_offset[block] = eq;
+            greater_offset[block] = gt;
+            lt += less[block];
+            eq += equal[block];
+            gt += block_end(block) - block*PARTITION_BLOCK - less[block] - equal[block];
+        }
+
+        parallel_for(nblocks, nthreads, [&](size_t block) {
+            size_t lt = less_offset[block];
+            size_t eq = equal_offset[block];
+            size_t gt = greater_offset[block];
+            for (size_t j = block*PARTITION_BLOCK; j < block_end(block); ++j) {
+                if (pts[j][axis] < pivot) {
+                    scratch[lt++] = pts[j];
+                } else if (pts[j][axis] == pivot) {
+                    scratch[eq++] = pts[j];
+                } else {
+                    scratch[gt++] = pts[j];
+                }
+            }
+        });
+
+        parallel_for(nblocks, nthreads, [&](size_t block) {
+            size_t first = block*PARTITION_BLOCK;
+            std::copy(scratch + first, scratch + block_end(block), pts + first);
+        });
+    }
+
+    template<class Fn> static void parallel_for(size_t count, size_t nthreads,
+        Fn fn)
+    {
+        std::atomic<size_t> next(0);
+        auto worker = [&]() {
+            for (size_t i = next++; i < count; i = next++) fn(i);
+        };
+
+        std::vector<std::thread> threads;
+        for (size_t i = 1; i < nthreads && i < count; ++i) {
+            threads.push_back(std::thread(worker));
+        }
+        worker();
+
+        for (auto& thread : threads) {
+            thread.join();
+        }
+    }
+
+    Number distance(const Point &a, const Point &b) const
+    {
+        Number result = 0;
+        for (size_t j = 0; j < dim; ++j) {
+            Number d = a[j] - b[j];
+            result += d*d;
+        }
+
+        return result;
+    }
+
+    //calls fn(Point *, Number) for every point within the squared radius
+    //of pt, returning how many there were
+    template<class Fn> size_t gather(const Point &pt, Number radius2,
+        Scratch &scratch, Fn &&fn) const
+    {
+        if (!n) return 0;
+
+        size_t count = 0;
+        scratch.stack.clear();
+        scratch.stack.push_back(std::make_pair((size_t)1, (Number)0));
+
+        while (!scratch.stack.empty()) {
+            size_t i = scratch.stack.back().first;
+            scratch.stack.pop_back();
+
+            while (i <= n) {
+                Point *node = &points[i - 1];
+                Number d2 = distance(*node, pt);
+                if (d2 <= radius2) {
+                    fn(node, d2);
+                    ++count;
+                }
+
+                if (2*i > n) break;
+
+                int axis = node->get_axis();
+                Number d = pt[axis] - (*node)[axis];
+                size_t far = d < 0 ? 2*i + 1 : 2*i;
+                if (far <= n && d*d <= radius2) {
+                    scratch.stack.push_back(std::make_pair(far, d*d));
+                }
+
+                i = d < 0 ? 2*i : 2*i + 1;
+            }
+        }
+
+        return count;
+    }
+
+    //finds the points within sqrt(radius2) of pt for knn_packet and lays
+    //out their coordinates in blocks
+    void gather(const Point &pt, Number radius2, PacketScratch &scratch) const
+    {
+        scratch.candidates.clear();
+        gather(pt, radius2, scratch.scratch, [&](Point *node, Number) {
+            scratch.candidates.push_back(node);
+        });
+
+        size_t m = scratch.candidates.size();
+        size_t nblocks = (m + VECTOR_SIZE - 1)/VECTOR_SIZE;
+        scratch.blocks.resize(nblocks*dim);
+        for (size_t c = 0; c < nblocks*VECTOR_SIZE; ++c) {
+            for (size_t j = 0; j < dim; ++j) {
+                scratch.blocks[c/VECTOR_SIZE*dim + j].coord[c % VECTOR_SIZE] =
+                    c < m ? (*scratch.candidates[c])[j] : 0;
+            }
+        }
+    }
+
+    static void sift_up(Neighbour *heap, size_t i)
+    {
+        while (i && heap[(i - 1)/2].distance < heap[i].distance) {
+            std::swap(heap[(i - 1)/2], heap[i]);
+            i = (i - 1)/2;
+        }
+    }
+
+    static void sift_down(Neighbour *heap, size_t i, size_t length)
+    {
+        while (1) {
+            size_t largest = i;
+            size_t l = 2*i + 1;
+            size_t r = l + 1;
+            if (l < length && heap[l].distance > heap[largest].distance) largest = l;
+            if (r < length && heap[r].distance > heap[largest].distance) largest = r;
+            if (largest == i) return;
+
+            std::swap(heap[i], heap[largest]);
+            i = largest;
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,113 @@
+/*
+Copyright (c) 2018 Daniel Minor
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#ifndef BOUNDING_BOX_H_
+#define BOUNDING_BOX_H_
+
+#include <algorithm>
+#include <limits>
+
+#include "vec.h"
+
+struct BoundingBox {
+
+    Vec min;
+    Vec max;
+
+    //an empty box, expanding it by any point gives a box containing that point
+    BoundingBox()
+        : min(std::numeric_limits<double>::max(),
+              std::numeric_limits<double>::max(),
+              std::numeric_limits<double>::max())
+        , max(-std::numeric_limits<double>::max(),
+              -std::numeric_limits<double>::max(),
+              -std::numeric_limits<double>::max())
+    {
+    }
+
+    BoundingBox(const Vec &min, const Vec &max) : min(min), max(max)
+    {
+    }
+
+    bool empty() const
+    {
+        return min.x > max.x || min.y > max.y || min.z > max.z;
+    }
+
+    void expand(const Vec &pt)
+    {
+        min.x = std::min(min.x, pt.x);
+        min.y = std::min(min.y, pt.y);
+        min.z = std::min(min.z, pt.z);
+        max.x = std::max(max.x, pt.x);
+        max.y = std::max(max.y, pt.y);
+        max.z = std::max(max.z, pt.z);
+    }
+
+    void expand(const BoundingBox &other)
+    {
+        expand(other.min);
+        expand(other.max);
+    }
+
+    Vec centroid() const
+    {
+        return (min + max)*0.5;
+    }
+
+    Vec corner(int i) const
+    {
+        return Vec(i & 1 ? max.x : min.x,
+                   i & 2 ? max.y : min.y,
+                   i & 4 ? max.z : min.z);
+    }
+
+    double surface_area() const
+    {
+        if (empty()) return 0.0;
+
+        Vec d = max - min;
+        return 2.0*(d.x*d.y + d.y*d.z + d.z*d.x);
+    }
+
+    //slab test, inv_direction holds the reciprocals of the ray direction
+    bool intersect(const Vec &origin, const Vec &inv_direction,
+        double tmin, double tmax) const
+    {
+        for (int axis = 0; axis < 3; ++axis) {
+            double o = (&origin.x)[axis];
+            double inv = (&inv_direction.x)[axis];
+            double t0 = ((&min.x)[axis] - o)*inv;
+            double t1 = ((&max.x)[axis] - o)*inv;
+            if (t0 > t1) std::swap(t0, t1);
+
+            //written so that NaNs (a ray lying in a slab plane) are ignored
+            tmin = t0 > tmin ? t0 : tmin;
+            tmax = t1 < tmax ? t1 : tmax;
+            if (tmin > tmax) return false;
+        }
+
+        return true;
+    }
+};
+
+#endif
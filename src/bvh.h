@@ -0,0 +1,834 @@
+/*
+Copyright (c) 2018 Daniel Minor
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#ifndef BVH_H_
+#define BVH_H_
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include "bounding_box.h"
+#include "ray.h"
+#include "ray_packet.h"
+#include "vec.h"
+
+/*
+Bounding volume hierarchy built using the surface area heuristic. The
+hierarchy only stores indices, it is up to the owner to map these back to
+objects, e.g. the children of a Group or the faces of a TriangleMesh.
+
+The binary tree may be collapsed into 4 or 8 wide nodes, which store their
+child boxes as arrays of floats so that they can be tested together using
+SSE or AVX where available.
+*/
+class BVH {
+
+public:
+
+    struct Node {
+        BoundingBox bounds;
+        uint32_t offset;    //leaf: first entry in indices, interior: right child
+        uint32_t count;     //leaf: number of entries in indices, interior: zero
+        uint32_t axis;      //split axis of interior nodes, the left child is
+                            //the next node in the array
+    };
+
+    struct WideNode {
+        float min_x[8], min_y[8], min_z[8];
+        float max_x[8], max_y[8], max_z[8];
+        uint32_t offset[8]; //leaf: first entry in indices, interior: wide node
+        uint32_t count[8];  //leaf: number of entries in indices, interior: zero
+        uint32_t children;
+    };
+
+    std::vector<Node> nodes;
+    std::vector<WideNode> wide_nodes;
+    std::vector<size_t> indices;
+
+    //number of children per node, 2 for the binary tree, otherwise 4 or 8
+    size_t width;
+
+    BVH() : width(2)
+    {
+    }
+
+    bool empty() const
+    {
+        return nodes.empty() && wide_nodes.empty();
+    }
+
+    /** This function builds the hierarchy.
+
+        \param bounds The bounding box of each object to be stored, the index
+                      of the box is the index reported during traversal.
+        \param width The number of children per node, either 2, 4 or 8.
+    */
+    void build(const std::vector<BoundingBox> &bounds, size_t width = 2)
+    {
+        nodes.clear();
+        wide_nodes.clear();
+        indices.clear();
+        this->width = width == 4 || width == 8 ? width : 2;
+
+        if (bounds.empty()) return;
+
+        std::vector<BuildEntry> entries(bounds.size());
+        for (size_t i = 0; i < bounds.size(); ++i) {
+            entries[i].bounds = bounds[i];
+            entries[i].centroid = bounds[i].centroid();
+            entries[i].index = i;
+        }
+
+        nodes.reserve(2*bounds.size());
+        indices.reserve(bounds.size());
+        build_node(entries, 0, entries.size(), 0);
+
+        //binary nodes are only needed to build the wide nodes
+        if (this->width > 2) {
+            wide_nodes.reserve(nodes.size()/(this->width - 1) + 1);
+            collapse(0);
+            std::vector<Node>().swap(nodes);
+        }
+    }
+
+    /** This function traverses the hierarchy front to back, calling fn for
+        every object whose bounding box is hit by the ray.
+
+        \param ray The ray to trace.
+        \param tmin The minimum distance along the ray.
+        \param tmax The maximum distance along the ray. fn should reduce this
+                    when it finds a hit so that further nodes can be culled.
+        \param fn Called as fn(index, tmin, tmax) and should return true if
+                  the object was hit.
+        \return True if fn reported any hit.
+    */
+    template<class Fn> bool intersect(const Ray &ray, double tmin,
+        double &tmax, Fn &fn) const
+    {
+        if (width > 2) return intersect_wide(ray, tmin, tmax, fn);
+        if (nodes.empty()) return false;
+
+        Vec inv_direction(1.0/ray.direction.x, 1.0/ray.direction.y,
+            1.0/ray.direction.z);
+        bool negative[3] = {inv_direction.x < 0.0, inv_direction.y < 0.0,
+            inv_direction.z < 0.0};
+
+        bool hit = false;
+        uint32_t stack[MAX_DEPTH + 1];
+        size_t top = 0;
+        uint32_t current = 0;
+
+        while (true) {
+            const Node &node = nodes[current];
+
+            if (node.bounds.intersect(ray.origin, inv_direction, tmin, tmax)) {
+                if (node.count) {
+                    for (uint32_t i = node.offset; i < node.offset + node.count; ++i) {
+                        if (fn(indices[i], tmin, tmax)) hit = true;
+                    }
+                } else {
+                    //visit nearer child first
+                    if (negative[node.axis]) {
+                        stack[top++] = current + 1;
+                        current = node.offset;
+                    } else {
+                        stack[top++] = node.offset;
+                        current = current + 1;
+                    }
+                    continue;
+                }
+            }
+
+            if (!top) break;
+            current = stack[--top];
+        }
+
+        return hit;
+    }
+
+    /** This function traverses the hierarchy until any object reports a
+        hit, in no particular order.
+
+        \param ray The ray to trace.
+        \param tmin The minimum distance along the ray.
+        \param tmax The maximum distance along the ray.
+        \param fn Called as fn(index, tmin, tmax) and should return true if
+                  the object was hit.
+        \return True if fn reported a hit.
+    */
+    template<class Fn> bool occluded(const Ray &ray, double tmin,
+        double tmax, Fn &fn) const
+    {
+        if (width > 2) return occluded_wide(ray, tmin, tmax, fn);
+        if (nodes.empty()) return false;
+
+        Vec inv_direction(1.0/ray.direction.x, 1.0/ray.direction.y,
+            1.0/ray.direction.z);
+
+        uint32_t stack[MAX_DEPTH + 1];
+        size_t top = 0;
+        stack[top++] = 0;
+
+        while (top) {
+            uint32_t current = stack[--top];
+            const Node &node = nodes[current];
+
+            if (!node.bounds.intersect(ray.origin, inv_direction, tmin, tmax)) {
+                continue;
+            }
+
+            if (node.count) {
+                for (uint32_t i = node.offset; i < node.offset + node.count; ++i) {
+                    if (fn(indices[i], tmin, tmax)) return true;
+                }
+            } else {
+                stack[top++] = node.offset;
+                stack[top++] = current + 1;
+            }
+        }
+
+        return false;
+    }
+
+    /** This function traverses the hierarchy with a packet of rays. A node
+        is visited if any active ray hits its box, and objects are reported
+        along with the mask of rays which reached them.
+
+        \param packet The rays to trace.
+        \param active A bit mask selecting the rays to trace.
+        \param tmin The minimum distance along the rays.
+        \param tmax The maximum distance along each ray. fn should reduce
+                    these when it finds hits so that further nodes can be
+                    culled.
+        \param fn Called as fn(index, mask, tmin, tmax) and should return the
+                  mask of rays which hit the object.
+        \return The mask of rays for which fn reported a hit.
+    */
+    template<class Fn> unsigned intersect_packet(const RayPacket &packet,
+        unsigned active, double tmin, double *tmax, Fn &fn) const
+    {
+        if (width > 2) return intersect_packet_wide(packet, active, tmin, tmax, fn);
+        if (nodes.empty()) return 0;
+
+        Vec inv_direction[RayPacket::SIZE];
+        for (int i = 0; i < RayPacket::SIZE; ++i) {
+            const Vec &d = packet.rays[i].direction;
+            inv_direction[i] = Vec(1.0/d.x, 1.0/d.y, 1.0/d.z);
+        }
+
+        struct Entry {
+            uint32_t node;
+            unsigned mask;
+        };
+
+        unsigned hits = 0;
+        Entry stack[MAX_DEPTH + 1];
+        size_t top = 0;
+        stack[top++] = Entry{0, active};
+
+        while (top) {
+            Entry entry = stack[--top];
+            const Node &node = nodes[entry.node];
+
+            //drop rays which miss this node
+            unsigned mask = 0;
+            int first = -1;
+            for (int i = 0; i < RayPacket::SIZE; ++i) {
+                if (!(entry.mask & (1u << i))) continue;
+
+                if (node.bounds.intersect(packet.rays[i].origin,
+                        inv_direction[i], tmin, tmax[i])) {
+                    mask |= 1u << i;
+                    if (first < 0) first = i;
+                }
+            }
+
+            if (!mask) continue;
+
+            if (node.count) {
+                for (uint32_t i = node.offset; i < node.offset + node.count; ++i) {
+                    hits |= fn(indices[i], mask, tmin, tmax);
+                }
+            } else if ((&inv_direction[first].x)[node.axis] < 0.0) {
+                //order children using the first ray which reached this node
+                stack[top++] = Entry{entry.node + 1, mask};
+                stack[top++] = Entry{node.offset, mask};
+            } else {
+                stack[top++] = Entry{node.offset, mask};
+                stack[top++] = Entry{entry.node + 1, mask};
+            }
+        }
+
+        return hits;
+    }
+
+    //true if 8 wide nodes can be tested with AVX on this processor
+    static bool has_avx()
+    {
+        #if defined(__SSE2__) && defined(__GNUC__)
+        static bool result = __builtin_cpu_supports("avx");
+        return result;
+        #else
+        return false;
+        #endif
+    }
+
+private:
+
+    static const size_t MAX_DEPTH = 64;
+    static const size_t MAX_LEAF_SIZE = 4;
+    static const size_t BINS = 16;
+
+    //relative costs of visiting a node and intersecting an object
+    static constexpr double TRAVERSAL_COST = 1.0;
+    static constexpr double INTERSECTION_COST = 2.0;
+
+    struct BuildEntry {
+        BoundingBox bounds;
+        Vec centroid;
+        size_t index;
+    };
+
+    struct Bin {
+        BoundingBox bounds;
+        size_t count;
+    };
+
+    uint32_t make_leaf(std::vector<BuildEntry> &entries, size_t start,
+        size_t end, const BoundingBox &bounds)
+    {
+        uint32_t result = nodes.size();
+        nodes.push_back(Node{bounds, (uint32_t)indices.size(),
+            (uint32_t)(end - start), 0});
+        for (size_t i = start; i < end; ++i) {
+            indices.push_back(entries[i].index);
+        }
+
+        return result;
+    }
+
+    uint32_t build_node(std::vector<BuildEntry> &entries, size_t start,
+        size_t end, size_t depth)
+    {
+        BoundingBox bounds, centroid_bounds;
+        for (size_t i = start; i < end; ++i) {
+            bounds.expand(entries[i].bounds);
+            centroid_bounds.expand(entries[i].centroid);
+        }
+
+        size_t count = end - start;
+        if (count == 1 || depth == MAX_DEPTH) {
+            return make_leaf(entries, start, end, bounds);
+        }
+
+        //find cheapest split over binned centroids on each axis
+        double best_cost = std::numeric_limits<double>::max();
+        int best_axis = -1;
+        size_t best_split = 0;
+        for (int axis = 0; axis < 3; ++axis) {
+            double lo = (&centroid_bounds.min.x)[axis];
+            double hi = (&centroid_bounds.max.x)[axis];
+            if (hi <= lo) continue;
+
+            Bin bins[BINS];
+            for (size_t b = 0; b < BINS; ++b) bins[b].count = 0;
+
+            double scale = BINS/(hi - lo);
+            for (size_t i = start; i < end; ++i) {
+                size_t b = bin_index((&entries[i].centroid.x)[axis], lo, scale);
+                bins[b].bounds.expand(entries[i].bounds);
+                ++bins[b].count;
+            }
+
+            //sweep from the right to get areas of each possible right side
+            double right_area[BINS];
+            size_t right_count[BINS];
+            BoundingBox right;
+            size_t n = 0;
+            for (size_t b = BINS - 1; b > 0; --b) {
+                right.expand(bins[b].bounds);
+                n += bins[b].count;
+                right_area[b] = right.surface_area();
+                right_count[b] = n;
+            }
+
+            BoundingBox left;
+            n = 0;
+            for (size_t b = 0; b < BINS - 1; ++b) {
+                left.expand(bins[b].bounds);
+                n += bins[b].count;
+                if (!n || !right_count[b + 1]) continue;
+
+                double cost = left.surface_area()*n
+                    + right_area[b + 1]*right_count[b + 1];
+                if (cost < best_cost) {
+                    best_cost = cost;
+                    best_axis = axis;
+                    best_split = b + 1;
+                }
+            }
+        }
+
+        double leaf_cost = INTERSECTION_COST*count;
+        double area = bounds.surface_area();
+        if (best_axis >= 0 && area > 0.0) {
+            best_cost = TRAVERSAL_COST + INTERSECTION_COST*best_cost/area;
+        }
+
+        size_t mid;
+        if (best_axis < 0) {
+            //all centroids coincide, no split can separate the objects
+            if (count <= MAX_LEAF_SIZE) {
+                return make_leaf(entries, start, end, bounds);
+            }
+            best_axis = 0;
+            mid = start + count/2;
+        } else if (best_cost >= leaf_cost && count <= MAX_LEAF_SIZE) {
+            return make_leaf(entries, start, end, bounds);
+        } else {
+            double lo = (&centroid_bounds.min.x)[best_axis];
+            double scale = BINS/((&centroid_bounds.max.x)[best_axis] - lo);
+            BuildEntry *first = &entries[start];
+            BuildEntry *last = &entries[0] + end;
+            mid = std::partition(first, last, [&](const BuildEntry &e) {
+                return bin_index((&e.centroid.x)[best_axis], lo, scale) < best_split;
+            }) - &entries[0];
+        }
+
+        uint32_t result = nodes.size();
+        nodes.push_back(Node{bounds, 0, 0, (uint32_t)best_axis});
+        build_node(entries, start, mid, depth + 1);
+        uint32_t right = build_node(entries, mid, end, depth + 1);
+        nodes[result].offset = right;
+
+        return result;
+    }
+
+    static size_t bin_index(double centroid, double lo, double scale)
+    {
+        size_t b = (size_t)((centroid - lo)*scale);
+        return b < BINS ? b : BINS - 1;
+    }
+
+    template<class Fn> bool intersect_wide(const Ray &ray, double tmin,
+        double &tmax, Fn &fn) const
+    {
+        if (wide_nodes.empty()) return false;
+
+        WideRay r;
+        r.origin[0] = ray.origin.x;
+        r.origin[1] = ray.origin.y;
+        r.origin[2] = ray.origin.z;
+        r.inv_direction[0] = 1.0f/(float)ray.direction.x;
+        r.inv_direction[1] = 1.0f/(float)ray.direction.y;
+        r.inv_direction[2] = 1.0f/(float)ray.direction.z;
+        r.tmin = tmin;
+
+        bool avx = width == 8 && has_avx();
+
+        //each entry records the distance at which its box was entered so
+        //that it can be skipped if a closer hit has been found since
+        struct Entry {
+            uint32_t offset;
+            uint32_t count;
+            float tnear;
+        };
+
+        bool hit = false;
+        Entry stack[MAX_DEPTH*8 + 1];
+        size_t top = 0;
+        stack[top++] = Entry{0, 0, (float)tmin};
+
+        while (top) {
+            Entry entry = stack[--top];
+            float ftmax = float_tmax(tmax);
+            if (entry.tnear > ftmax) continue;
+
+            if (entry.count) {
+                for (uint32_t i = entry.offset; i < entry.offset + entry.count; ++i) {
+                    if (fn(indices[i], tmin, tmax)) hit = true;
+                }
+                continue;
+            }
+
+            const WideNode &node = wide_nodes[entry.offset];
+            float tnear[8];
+            int mask;
+            if (avx) {
+                mask = box_test8(node, r, ftmax, tnear);
+            } else {
+                mask = box_test4(node, 0, r, ftmax, tnear);
+                if (width == 8) {
+                    mask |= box_test4(node, 4, r, ftmax, tnear + 4) << 4;
+                }
+            }
+            mask &= (1 << node.children) - 1;
+
+            //push hit children furthest first so the nearest is popped first
+            size_t first = top;
+            for (uint32_t i = 0; i < node.children; ++i) {
+                if (!(mask & (1 << i))) continue;
+
+                Entry child{node.offset[i], node.count[i], tnear[i]};
+                size_t j = top++;
+                while (j > first && stack[j - 1].tnear < child.tnear) {
+                    stack[j] = stack[j - 1];
+                    --j;
+                }
+                stack[j] = child;
+            }
+        }
+
+        return hit;
+    }
+
+    template<class Fn> bool occluded_wide(const Ray &ray, double tmin,
+        double tmax, Fn &fn) const
+    {
+        if (wide_nodes.empty()) return false;
+
+        WideRay r;
+        r.origin[0] = ray.origin.x;
+        r.origin[1] = ray.origin.y;
+        r.origin[2] = ray.origin.z;
+        r.inv_direction[0] = 1.0f/(float)ray.direction.x;
+        r.inv_direction[1] = 1.0f/(float)ray.direction.y;
+        r.inv_direction[2] = 1.0f/(float)ray.direction.z;
+        r.tmin = tmin;
+
+        bool avx = width == 8 && has_avx();
+        float ftmax = float_tmax(tmax);
+
+        uint32_t stack[MAX_DEPTH*8 + 1];
+        size_t top = 0;
+        stack[top++] = 0;
+
+        while (top) {
+            const WideNode &node = wide_nodes[stack[--top]];
+
+            float tnear[8];
+            int mask;
+            if (avx) {
+                mask = box_test8(node, r, ftmax, tnear);
+            } else {
+                mask = box_test4(node, 0, r, ftmax, tnear);
+                if (width == 8) {
+                    mask |= box_test4(node, 4, r, ftmax, tnear + 4) << 4;
+                }
+            }
+            mask &= (1 << node.children) - 1;
+
+            for (uint32_t c = 0; c < node.children; ++c) {
+                if (!(mask & (1 << c))) continue;
+
+                if (node.count[c]) {
+                    uint32_t end = node.offset[c] + node.count[c];
+                    for (uint32_t i = node.offset[c]; i < end; ++i) {
+                        if (fn(indices[i], tmin, tmax)) return true;
+                    }
+                } else {
+                    stack[top++] = node.offset[c];
+                }
+            }
+        }
+
+        return false;
+    }
+
+    template<class Fn> unsigned intersect_packet_wide(const RayPacket &packet,
+        unsigned active, double tmin, double *tmax, Fn &fn) const
+    {
+        if (wide_nodes.empty()) return 0;
+
+        WideRay r[RayPacket::SIZE];
+        for (int i = 0; i < RayPacket::SIZE; ++i) {
+            const Ray &ray = packet.rays[i];
+            r[i].origin[0] = ray.origin.x;
+            r[i].origin[1] = ray.origin.y;
+            r[i].origin[2] = ray.origin.z;
+            r[i].inv_direction[0] = 1.0f/(float)ray.direction.x;
+            r[i].inv_direction[1] = 1.0f/(float)ray.direction.y;
+            r[i].inv_direction[2] = 1.0f/(float)ray.direction.z;
+            r[i].tmin = tmin;
+        }
+
+        bool avx = width == 8 && has_avx();
+
+        struct Entry {
+            uint32_t offset;
+            uint32_t count;
+            unsigned mask;
+            float tnear;
+        };
+
+        unsigned hits = 0;
+        Entry stack[MAX_DEPTH*8 + 1];
+        size_t top = 0;
+        stack[top++] = Entry{0, 0, active, (float)tmin};
+
+        while (top) {
+            Entry entry = stack[--top];
+
+            if (entry.count) {
+                for (uint32_t i = entry.offset; i < entry.offset + entry.count; ++i) {
+                    hits |= fn(indices[i], entry.mask, tmin, tmax);
+                }
+                continue;
+            }
+
+            //find which rays hit each child, the entry distance of a child is
+            //its nearest over all of those rays
+            const WideNode &node = wide_nodes[entry.offset];
+            unsigned child_masks[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+            float child_tnear[8];
+            for (uint32_t c = 0; c < node.children; ++c) {
+                child_tnear[c] = std::numeric_limits<float>::infinity();
+            }
+
+            for (int i = 0; i < RayPacket::SIZE; ++i) {
+                if (!(entry.mask & (1u << i))) continue;
+
+                float ftmax = float_tmax(tmax[i]);
+                float tnear[8];
+                int mask;
+                if (avx) {
+                    mask = box_test8(node, r[i], ftmax, tnear);
+                } else {
+                    mask = box_test4(node, 0, r[i], ftmax, tnear);
+                    if (width == 8) {
+                        mask |= box_test4(node, 4, r[i], ftmax, tnear + 4) << 4;
+                    }
+                }
+
+                for (uint32_t c = 0; c < node.children; ++c) {
+                    if (mask & (1 << c)) {
+                        child_masks[c] |= 1u << i;
+                        child_tnear[c] = std::min(child_tnear[c], tnear[c]);
+                    }
+                }
+            }
+
+            //push hit children furthest first so the nearest is popped first
+            size_t first = top;
+            for (uint32_t c = 0; c < node.children; ++c) {
+                if (!child_masks[c]) continue;
+
+                Entry child{node.offset[c], node.count[c], child_masks[c],
+                    child_tnear[c]};
+                size_t j = top++;
+                while (j > first && stack[j - 1].tnear < child.tnear) {
+                    stack[j] = stack[j - 1];
+                    --j;
+                }
+                stack[j] = child;
+            }
+        }
+
+        return hits;
+    }
+
+    struct WideRay {
+        float origin[3];
+        float inv_direction[3];
+        float tmin;
+    };
+
+    static float float_tmax(double tmax)
+    {
+        if (tmax >= std::numeric_limits<float>::max()) {
+            return std::numeric_limits<float>::infinity();
+        }
+
+        //round up so that boxes at exactly tmax are not culled
+        float result = (float)tmax;
+        return result + std::fabs(result)*1e-6f;
+    }
+
+    //float bounds rounded outwards so that the boxes remain conservative
+    static float lower(double d, double extent)
+    {
+        double pad = (std::fabs(d) + extent)*1e-6;
+        return std::nextafter((float)(d - pad), -std::numeric_limits<float>::infinity());
+    }
+
+    static float upper(double d, double extent)
+    {
+        double pad = (std::fabs(d) + extent)*1e-6;
+        return std::nextafter((float)(d + pad), std::numeric_limits<float>::infinity());
+    }
+
+    uint32_t collapse(uint32_t binary)
+    {
+        //open the largest interior node until the wide node is full
+        uint32_t children[8];
+        size_t n = 0;
+        if (nodes[binary].count) {
+            children[n++] = binary;
+        } else {
+            children[n++] = binary + 1;
+            children[n++] = nodes[binary].offset;
+        }
+
+        while (n < width) {
+            int largest = -1;
+            double largest_area = -1.0;
+            for (size_t i = 0; i < n; ++i) {
+                const Node &node = nodes[children[i]];
+                if (!node.count && node.bounds.surface_area() > largest_area) {
+                    largest = i;
+                    largest_area = node.bounds.surface_area();
+                }
+            }
+
+            if (largest < 0) break;
+
+            uint32_t opened = children[largest];
+            children[largest] = opened + 1;
+            children[n++] = nodes[opened].offset;
+        }
+
+        uint32_t result = wide_nodes.size();
+        wide_nodes.push_back(WideNode());
+        wide_nodes[result].children = n;
+
+        for (size_t i = 0; i < n; ++i) {
+            const Node &node = nodes[children[i]];
+            const BoundingBox &b = node.bounds;
+            double extent = (b.max - b.min).magnitude();
+
+            uint32_t offset = node.count ? node.offset : collapse(children[i]);
+
+            WideNode &wide = wide_nodes[result];
+            wide.min_x[i] = lower(b.min.x, extent);
+            wide.min_y[i] = lower(b.min.y, extent);
+            wide.min_z[i] = lower(b.min.z, extent);
+            wide.max_x[i] = upper(b.max.x, extent);
+            wide.max_y[i] = upper(b.max.y, extent);
+            wide.max_z[i] = upper(b.max.z, extent);
+            wide.offset[i] = offset;
+            wide.count[i] = node.count;
+        }
+
+        //unused slots hold empty boxes
+        WideNode &wide = wide_nodes[result];
+        for (size_t i = n; i < 8; ++i) {
+            wide.min_x[i] = wide.min_y[i] = wide.min_z[i] = 1.0f;
+            wide.max_x[i] = wide.max_y[i] = wide.max_z[i] = -1.0f;
+            wide.offset[i] = wide.count[i] = 0;
+        }
+
+        return result;
+    }
+
+    //tests children [first, first + 4) of a node, returning a bit mask of
+    //those hit along with their entry distances
+    static int box_test4(const WideNode &node, size_t first, const WideRay &r,
+        float tmax, float *tnear)
+    {
+        #if defined(__SSE2__)
+        __m128 lo = _mm_set1_ps(r.tmin);
+        __m128 hi = _mm_set1_ps(tmax);
+
+        const float *mins[3] = {node.min_x, node.min_y, node.min_z};
+        const float *maxs[3] = {node.max_x, node.max_y, node.max_z};
+        for (int axis = 0; axis < 3; ++axis) {
+            __m128 o = _mm_set1_ps(r.origin[axis]);
+            __m128 inv = _mm_set1_ps(r.inv_direction[axis]);
+            __m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(mins[axis] + first), o), inv);
+            __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(maxs[axis] + first), o), inv);
+            lo = _mm_max_ps(_mm_min_ps(t0, t1), lo);
+            hi = _mm_min_ps(_mm_max_ps(t0, t1), hi);
+        }
+
+        _mm_storeu_ps(tnear, lo);
+        return _mm_movemask_ps(_mm_cmple_ps(lo, hi));
+        #else
+        return box_test_scalar(node, first, 4, r, tmax, tnear);
+        #endif
+    }
+
+    #if defined(__SSE2__) && defined(__GNUC__)
+    __attribute__((target("avx")))
+    static int box_test8(const WideNode &node, const WideRay &r, float tmax,
+        float *tnear)
+    {
+        __m256 lo = _mm256_set1_ps(r.tmin);
+        __m256 hi = _mm256_set1_ps(tmax);
+
+        const float *mins[3] = {node.min_x, node.min_y, node.min_z};
+        const float *maxs[3] = {node.max_x, node.max_y, node.max_z};
+        for (int axis = 0; axis < 3; ++axis) {
+            __m256 o = _mm256_set1_ps(r.origin[axis]);
+            __m256 inv = _mm256_set1_ps(r.inv_direction[axis]);
+            __m256 t0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(mins[axis]), o), inv);
+            __m256 t1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(maxs[axis]), o), inv);
+            lo = _mm256_max_ps(_mm256_min_ps(t0, t1), lo);
+            hi = _mm256_min_ps(_mm256_max_ps(t0, t1), hi);
+        }
+
+        _mm256_storeu_ps(tnear, lo);
+        return _mm256_movemask_ps(_mm256_cmp_ps(lo, hi, _CMP_LE_OQ));
+    }
+    #else
+    static int box_test8(const WideNode &node, const WideRay &r, float tmax,
+        float *tnear)
+    {
+        return box_test_scalar(node, 0, 8, r, tmax, tnear);
+    }
+    #endif
+
+    static int box_test_scalar(const WideNode &node, size_t first, size_t n,
+        const WideRay &r, float tmax, float *tnear)
+    {
+        int mask = 0;
+        for (size_t i = 0; i < n; ++i) {
+            const float mins[3] = {node.min_x[first + i], node.min_y[first + i],
+                node.min_z[first + i]};
+            const float maxs[3] = {node.max_x[first + i], node.max_y[first + i],
+                node.max_z[first + i]};
+
+            float lo = r.tmin;
+            float hi = tmax;
+            for (int axis = 0; axis < 3; ++axis) {
+                float t0 = (mins[axis] - r.origin[axis])*r.inv_direction[axis];
+                float t1 = (maxs[axis] - r.origin[axis])*r.inv_direction[axis];
+                if (t0 > t1) std::swap(t0, t1);
+                lo = t0 > lo ? t0 : lo;
+                hi = t1 < hi ? t1 : hi;
+            }
+
+            tnear[i] = lo;
+            if (lo <= hi) mask |= 1 << i;
+        }
+
+        return mask;
+    }
+};
+
+#endif
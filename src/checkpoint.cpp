@@ -0,0 +1,137 @@
+/*
+Copyright (c) 2018 Daniel Minor
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include "checkpoint.h"
+
+#include <cstdio>
+#include <cstring>
+
+static const char MAGIC[8] = {'R', 'T', 'C', 'K', 'P', 'T', '\r', '\n'};
+
+bool Checkpoint::save(const char *filename, const Framebuffer &framebuffer,
+    const PhotonMap *photon_map) const
+{
+    std::string temp = std::string(filename) + ".tmp";
+    FILE *f = fopen(temp.c_str(), "wb");
+    if (!f) {
+        fprintf(stderr, "error: could not open: %s\n", temp.c_str());
+        return false;
+    }
+
+    uint32_t header[4] = {VERSION, samples, next,
+        photon_map && !photon_map->empty()};
+    bool ok = fwrite(MAGIC, sizeof(MAGIC), 1, f) == 1
+        && fwrite(header, sizeof(header), 1, f) == 1
+        && fwrite(sampler, sizeof(sampler), 1, f) == 1
+        && framebuffer.save(f);
+    if (ok && header[3]) ok = photon_map->save(f);
+    if (fclose(f)) ok = false;
+
+    if (!ok || rename(temp.c_str(), filename)) {
+        fprintf(stderr, "error: could not write checkpoint: %s\n", filename);
+        remove(temp.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+bool Checkpoint::load(const char *filename, Framebuffer &framebuffer,
+    PhotonMap *photon_map, bool &has_photon_map)
+{
+    FILE *f = fopen(filename, "rb");
+    if (!f) {
+        fprintf(stderr, "error: could not open: %s\n", filename);
+        return false;
+    }
+
+    char magic[8];
+    uint32_t header[4];
+    bool ok = fread(magic, sizeof(magic), 1, f) == 1
+        && !memcmp(magic, MAGIC, sizeof(MAGIC))
+        && fread(header, sizeof(header), 1, f) == 1
+        && header[0] == VERSION
+        && fread(sampler, sizeof(sampler), 1, f) == 1
+        && framebuffer.load(f);
+
+    if (ok) {
+        sampler[sizeof(sampler) - 1] = 0;
+        samples = header[1];
+        next = header[2];
+        has_photon_map = header[3];
+        if (has_photon_map && photon_map) ok = photon_map->load(f);
+    }
+
+    fclose(f);
+
+    if (!ok) {
+        fprintf(stderr, "error: invalid checkpoint or image size differs: %s\n",
+            filename);
+    }
+
+    return ok;
+}
+
+CheckpointWriter::CheckpointWriter(const std::string &filename,
+    const PhotonMap *photon_map)
+    : filename(filename), photon_map(photon_map), done(false)
+{
+    thread = std::thread(&CheckpointWriter::run, this);
+}
+
+CheckpointWriter::~CheckpointWriter()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        done = true;
+    }
+    cv.notify_one();
+    thread.join();
+}
+
+void CheckpointWriter::write(const Checkpoint &checkpoint,
+    const Framebuffer &framebuffer)
+{
+    std::unique_ptr<Framebuffer> copy(new Framebuffer(framebuffer));
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        this->checkpoint = checkpoint;
+        pending = std::move(copy);
+    }
+    cv.notify_one();
+}
+
+void CheckpointWriter::run()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        cv.wait(lock, [this] { return done || pending; });
+        if (!pending) break;
+
+        std::unique_ptr<Framebuffer> framebuffer = std::move(pending);
+        Checkpoint checkpoint = this->checkpoint;
+
+        lock.unlock();
+        checkpoint.save(filename.c_str(), *framebuffer, photon_map);
+        lock.lock();
+    }
+}
@@ -0,0 +1,103 @@
+/*
+Copyright (c) 2018 Daniel Minor
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#ifndef CHECKPOINT_H_
+#define CHECKPOINT_H_
+
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "framebuffer.h"
+#include "photon_map.h"
+
+/*
+State needed to continue a render. Passes render every pixel for a range
+of sample indices, so the framebuffer and the index of the next sample is
+enough to carry on where a previous run stopped. The sampler is recorded
+so that resuming cannot mix sample sequences.
+*/
+struct Checkpoint {
+
+    static const uint32_t VERSION = 4;
+
+    char sampler[16];
+    uint32_t samples;       //pattern size the sampler was created with
+    uint32_t next;          //first sample index of the next pass
+
+    Checkpoint() : sampler(), samples(0), next(0) {};
+
+    /**
+        Writes a checkpoint to a temporary file which is then renamed over
+        filename, so an interrupted write leaves the previous checkpoint.
+
+        \param photon_map Embedded in the checkpoint if not null.
+    */
+    bool save(const char *filename, const Framebuffer &framebuffer,
+        const PhotonMap *photon_map) const;
+
+    /**
+        \param framebuffer Must be the same size as the one saved.
+        \param photon_map Loaded if the checkpoint contains a photon map and
+                          this is not null.
+        \param has_photon_map Set to whether the file contains a photon map.
+    */
+    bool load(const char *filename, Framebuffer &framebuffer,
+        PhotonMap *photon_map, bool &has_photon_map);
+};
+
+/*
+Writes checkpoints on a background thread so that rendering does not wait
+on disk. Only the most recent state is kept, if a write is still in
+progress when a newer checkpoint arrives the older pending one is dropped.
+*/
+class CheckpointWriter {
+
+public:
+
+    CheckpointWriter(const std::string &filename, const PhotonMap *photon_map);
+
+    //waits for any pending checkpoint to be written
+    virtual ~CheckpointWriter();
+
+    //copies the framebuffer and returns without writing
+    void write(const Checkpoint &checkpoint, const Framebuffer &framebuffer);
+
+private:
+
+    std::string filename;
+    const PhotonMap *photon_map;
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool done;
+    Checkpoint checkpoint;
+    std::unique_ptr<Framebuffer> pending;
+    std::thread thread;
+
+    void run();
+};
+
+#endif
@@ -23,8 +23,6 @@ THE SOFTWARE.
 #ifndef DIELECTRIC_MATERIAL_H_
 #define DIELECTRIC_MATERIAL_H_
 
-#include <cstdlib>
-
 #include "material.h"
 #include "ray.h"
 #include "scene.h"
@@ -39,7 +37,7 @@ struct DielectricMaterial : public Material {
     virtual ~DielectricMaterial() {};
 
     void shade(const Scene &scene, const Ray &incident, const Vec &pt,
-        const Vec &norm, float &r, float &g, float &b) const override
+        const Vec &norm, Sampler &sampler, float &r, float &g, float &b) const override
     {
 
         double d_dot_n = incident.direction.dot(norm);
@@ -49,7 +47,9 @@ struct DielectricMaterial : public Material {
         if (root < 0.0) {
             r = g = b = 1.0;
         } else {
-            if ((double)rand() /(double)RAND_MAX < 0.25) {
+            double u = sampler.get(Sampler::bounce_dimension(incident.depth,
+                Sampler::COMPONENT_CHOICE));
+            if (u < 0.25) {
                 //reflection
                 Ray ray;
                 ray.depth = incident.depth + 1;
@@ -68,7 +68,7 @@ struct DielectricMaterial : public Material {
 
                 //emit ray
                 if (scene.intersect(ray, 0.1, tmax, pt2, norm2, material)) {
-                    material->shade(scene, ray, pt2, norm2, r, g, b);
+                    material->shade(scene, ray, pt2, norm2, sampler, r, g, b);
                 } else {
                     r = g = b = 0.0;
                 }
@@ -96,7 +96,7 @@ struct DielectricMaterial : public Material {
 
                 //emit ray
                 if (scene.intersect(ray, 0.1, tmax, pt2, norm2, material)) {
-                    material->shade(scene, ray, pt2, norm2, r, g, b);
+                    material->shade(scene, ray, pt2, norm2, sampler, r, g, b);
                 } else {
                     r = g = b = 0.0;
                 }
@@ -31,8 +31,13 @@ THE SOFTWARE.
 struct DiffuseMaterial : public Material {
     float r, g, b;
 
+    virtual bool isDiffuse() const
+    {
+        return true;
+    }
+
     void shade(const Scene &scene, const Ray &incident, const Vec &pt,
-        const Vec &norm, float &r, float &g, float &b) const override
+        const Vec &norm, Sampler &sampler, float &r, float &g, float &b) const override
     {
         r = this->r;
         g = this->g;
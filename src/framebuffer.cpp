@@ -0,0 +1,207 @@
+/*
+Copyright (c) 2018 Daniel Minor
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include "framebuffer.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+Framebuffer::Framebuffer(size_t width, size_t height)
+    : width(width), height(height), r(width*height), g(width*height),
+      b(width*height), stats(width*height)
+{
+}
+
+void Framebuffer::get(size_t pixel, float &r, float &g, float &b) const
+{
+    int n = stats[pixel].n;
+    float scale = n ? 1.0f/n : 0.0f;
+    r = this->r[pixel]*scale;
+    g = this->g[pixel]*scale;
+    b = this->b[pixel]*scale;
+}
+
+bool Framebuffer::merge(const Framebuffer &other)
+{
+    if (other.width != width || other.height != height) return false;
+
+    for (size_t i = 0; i < width*height; ++i) {
+        r[i] += other.r[i];
+        g[i] += other.g[i];
+        b[i] += other.b[i];
+        stats[i].merge(other.stats[i]);
+    }
+
+    return true;
+}
+
+void Framebuffer::tonemap(Image &image) const
+{
+    TonemapScratch scratch;
+    for (size_t y = 0; y < height; ++y) {
+        tonemap_row(y, image.row(y), scratch);
+    }
+}
+
+void Framebuffer::tonemap_row(size_t y, unsigned char *row,
+    TonemapScratch &scratch) const
+{
+    scratch.scale.resize(width);
+    scratch.planes.resize(width*3);
+    float *scale = &scratch.scale[0];
+    unsigned char *planes = &scratch.planes[0];
+    unsigned char *out[3] = {planes, planes + width, planes + width*2};
+
+    const SampleStats *row_stats = &stats[y*width];
+    for (size_t x = 0; x < width; ++x) {
+        int n = row_stats[x].n;
+        scale[x] = n ? 1.0f/n : 0.0f;
+    }
+
+    const float *in[3] = {&r[y*width], &g[y*width], &b[y*width]};
+    for (int c = 0; c < 3; ++c) {
+        size_t x = 0;
+
+        #if defined(__SSE2__)
+        //four pixels of a channel at a time
+        const __m128 zero = _mm_setzero_ps();
+        const __m128 one = _mm_set1_ps(1.0f);
+        const __m128 max = _mm_set1_ps(255.0f);
+        for (; x + 4 <= width; x += 4) {
+            __m128 v = _mm_mul_ps(_mm_loadu_ps(in[c] + x),
+                _mm_loadu_ps(scale + x));
+            v = _mm_min_ps(_mm_max_ps(v, zero), one);
+            v = _mm_mul_ps(_mm_sqrt_ps(v), max);
+
+            //truncate like the scalar conversion and pack to bytes
+            __m128i i = _mm_cvttps_epi32(v);
+            i = _mm_packs_epi32(i, i);
+            i = _mm_packus_epi16(i, i);
+            int packed = _mm_cvtsi128_si32(i);
+            memcpy(out[c] + x, &packed, 4);
+        }
+        #endif
+
+        //the remainder, or the whole row without sse
+        for (; x < width; ++x) {
+            float v = in[c][x]*scale[x];
+            if (v < 0.0f) v = 0.0f;
+            if (v > 1.0f) v = 1.0f;
+            out[c][x] = (unsigned char)(sqrtf(v)*255.0f);
+        }
+    }
+
+    for (size_t x = 0; x < width; ++x) {
+        row[x*3] = out[0][x];
+        row[x*3 + 1] = out[1][x];
+        row[x*3 + 2] = out[2][x];
+    }
+}
+
+void Framebuffer::clear()
+{
+    std::fill(r.begin(), r.end(), 0.0f);
+    std::fill(g.begin(), g.end(), 0.0f);
+    std::fill(b.begin(), b.end(), 0.0f);
+    std::fill(stats.begin(), stats.end(), SampleStats());
+}
+
+bool Framebuffer::save_pfm(const char *filename) const
+{
+    FILE *f = fopen(filename, "wb");
+    if (!f) {
+        fprintf(stderr, "error: could not open: %s\n", filename);
+        return false;
+    }
+
+    //a negative scale marks the data as little endian
+    fprintf(f, "PF\n%zu %zu\n-1.0\n", width, height);
+
+    //rows are stored bottom to top
+    std::vector<float> row(width*3);
+    for (size_t y = height; y-- > 0;) {
+        for (size_t x = 0; x < width; ++x) {
+            get(y*width + x, row[x*3], row[x*3 + 1], row[x*3 + 2]);
+        }
+
+        if (fwrite(&row[0], sizeof(float), width*3, f) != width*3) {
+            fprintf(stderr, "error: could not write: %s\n", filename);
+            fclose(f);
+            return false;
+        }
+    }
+
+    fclose(f);
+
+    return true;
+}
+
+bool Framebuffer::save(FILE *f) const
+{
+    uint32_t size[2] = {(uint32_t)width, (uint32_t)height};
+    if (fwrite(size, sizeof(size), 1, f) != 1) return false;
+
+    size_t count = width*height;
+    if (fwrite(&r[0], sizeof(float), count, f) != count) return false;
+    if (fwrite(&g[0], sizeof(float), count, f) != count) return false;
+    if (fwrite(&b[0], sizeof(float), count, f) != count) return false;
+
+    for (const SampleStats &s : stats) {
+        int32_t n = s.n;
+        double v[2] = {s.mean, s.m2};
+        if (fwrite(&n, sizeof(n), 1, f) != 1) return false;
+        if (fwrite(v, sizeof(v), 1, f) != 1) return false;
+    }
+
+    return true;
+}
+
+bool Framebuffer::load(FILE *f)
+{
+    uint32_t size[2];
+    if (fread(size, sizeof(size), 1, f) != 1) return false;
+    if (size[0] != width || size[1] != height) return false;
+
+    size_t count = width*height;
+    if (fread(&r[0], sizeof(float), count, f) != count) return false;
+    if (fread(&g[0], sizeof(float), count, f) != count) return false;
+    if (fread(&b[0], sizeof(float), count, f) != count) return false;
+
+    for (SampleStats &s : stats) {
+        int32_t n;
+        double v[2];
+        if (fread(&n, sizeof(n), 1, f) != 1) return false;
+        if (fread(v, sizeof(v), 1, f) != 1) return false;
+        s.n = n;
+        s.mean = v[0];
+        s.m2 = v[1];
+    }
+
+    return true;
+}
@@ -0,0 +1,109 @@
+/*
+Copyright (c) 2018 Daniel Minor
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#ifndef FRAMEBUFFER_H_
+#define FRAMEBUFFER_H_
+
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include "image.h"
+#include "sample_stats.h"
+
+/*
+Linear float accumulation buffer. Each pixel holds the sum of its samples
+and their statistics rather than a final value, so further samples can be
+added at any time and buffers rendered separately can be merged. Colour
+is stored as separate planes so that tonemapping can process several
+pixels at once.
+*/
+class Framebuffer {
+
+public:
+
+    Framebuffer(size_t width, size_t height);
+
+    size_t get_width() const
+    {
+        return width;
+    }
+
+    size_t get_height() const
+    {
+        return height;
+    }
+
+    //adds a sample to a pixel, pixels are indexed by y*width + x
+    void add(size_t pixel, float r, float g, float b)
+    {
+        this->r[pixel] += r;
+        this->g[pixel] += g;
+        this->b[pixel] += b;
+        stats[pixel].add(0.2126*r + 0.7152*g + 0.0722*b);
+    }
+
+    const SampleStats &pixel_stats(size_t pixel) const
+    {
+        return stats[pixel];
+    }
+
+    //mean colour of a pixel, black if it has no samples
+    void get(size_t pixel, float &r, float &g, float &b) const;
+
+    //adds the samples of another framebuffer of the same size
+    bool merge(const Framebuffer &other);
+
+    //converts the mean of each pixel to 8 bits, clamping and applying the
+    //square root used as gamma
+    void tonemap(Image &image) const;
+
+    //per row working memory for tonemap_row, owned by the caller so that it
+    //is reused across rows
+    struct TonemapScratch {
+        std::vector<float> scale;
+        std::vector<unsigned char> planes;
+    };
+
+    //as tonemap for a single row, writing width rgb pixels to out
+    void tonemap_row(size_t y, unsigned char *out, TonemapScratch &scratch) const;
+
+    //removes all samples
+    void clear();
+
+    //writes the mean of each pixel as a portable float map
+    bool save_pfm(const char *filename) const;
+
+    //binary form of the accumulated samples, load fails if the size in the
+    //file differs from that of the framebuffer
+    bool save(FILE *f) const;
+    bool load(FILE *f);
+
+private:
+
+    size_t width, height;
+    std::vector<float> r, g, b;
+    std::vector<SampleStats> stats;
+
+};
+
+#endif
@@ -23,40 +23,132 @@ THE SOFTWARE.
 #ifndef GROUP_H_
 #define GROUP_H_
 
-#include <limits>
 #include <memory>
 #include <vector>
 
+#include "bvh.h"
 #include "intersectable.h"
 
 struct Group : public Intersectable {
 
     std::vector<std::unique_ptr<Intersectable> > children;
 
-    virtual bool intersect(const Ray &ray, double tmin, double tmax,
-        Vec &pt, Vec &norm, Material *&mat) const
+    //acceleration structure, children with bounds are stored in the bvh
+    //while unbounded children such as planes are tested individually
+    std::vector<Intersectable *> bounded;
+    std::vector<Intersectable *> unbounded;
+    BVH bvh;
+
+    //must be called once all children have been added, width is the
+    //number of children per bvh node
+    void build_bvh(size_t width = 2)
+    {
+        bounded.clear();
+        unbounded.clear();
+
+        std::vector<BoundingBox> boxes;
+        for (auto& child: children) {
+            BoundingBox box;
+            if (child->bounds(box)) {
+                bounded.push_back(child.get());
+                boxes.push_back(box);
+            } else {
+                unbounded.push_back(child.get());
+            }
+        }
+
+        bvh.build(boxes, width);
+    }
+
+    virtual bool bounds(BoundingBox &box) const
     {
-        bool hit = false;
-        double closest_distance = std::numeric_limits<double>::max();
+        box = BoundingBox();
         for (auto& child: children) {
-            Vec temp_pt;
-            Vec temp_norm;
-            Material *temp_mat;
-            if (child->intersect(ray, tmin, tmax,
-                                 temp_pt, temp_norm, temp_mat)) {
-                hit = true;
-                Vec dist_vec = temp_pt - ray.origin;
-                double distance = dist_vec.dot(dist_vec);
-                if (distance < closest_distance) {
-                    closest_distance = distance;
-                    pt = temp_pt;
-                    norm = temp_norm;
-                    mat = temp_mat;
-                }
+            BoundingBox child_box;
+            if (!child->bounds(child_box)) return false;
+            box.expand(child_box);
+        }
+
+        return true;
+    }
+
+    using Intersectable::intersect;
+
+    virtual bool intersect(const Ray &ray, double tmin, Hit &hit) const
+    {
+        //each hit shrinks hit.t, so the last hit reported is the closest
+        bool found = false;
+        if (bounded.empty() && unbounded.empty()) {
+            for (auto& child: children) {
+                if (child->intersect(ray, tmin, hit)) found = true;
             }
+            return found;
         }
 
-        return hit;
+        for (auto child: unbounded) {
+            if (child->intersect(ray, tmin, hit)) found = true;
+        }
+
+        auto fn = [&](size_t index, double tmin, double &tmax) {
+            if (!bounded[index]->intersect(ray, tmin, hit)) return false;
+            tmax = hit.t;
+            return true;
+        };
+
+        if (bvh.intersect(ray, tmin, hit.t, fn)) found = true;
+
+        return found;
+    }
+
+    virtual bool occluded(const Ray &ray, double tmin, double tmax) const
+    {
+        if (bounded.empty() && unbounded.empty()) {
+            for (auto& child: children) {
+                if (child->occluded(ray, tmin, tmax)) return true;
+            }
+            return false;
+        }
+
+        for (auto child: unbounded) {
+            if (child->occluded(ray, tmin, tmax)) return true;
+        }
+
+        auto fn = [&](size_t index, double tmin, double tmax) {
+            return bounded[index]->occluded(ray, tmin, tmax);
+        };
+
+        return bvh.occluded(ray, tmin, tmax, fn);
+    }
+
+    virtual unsigned intersect_packet(const RayPacket &packet, unsigned active,
+        double tmin, Hit *hits) const
+    {
+        if (bounded.empty() && unbounded.empty()) {
+            return Intersectable::intersect_packet(packet, active, tmin, hits);
+        }
+
+        //children reduce hits[i].t for each ray they hit, so the last hit
+        //reported for a ray is the closest
+        unsigned found = 0;
+        for (auto child: unbounded) {
+            found |= child->intersect_packet(packet, active, tmin, hits);
+        }
+
+        double tmax[RayPacket::SIZE];
+        for (size_t i = 0; i < RayPacket::SIZE; ++i) tmax[i] = hits[i].t;
+
+        auto fn = [&](size_t index, unsigned mask, double tmin, double *tmax) {
+            unsigned hit = bounded[index]->intersect_packet(packet, mask, tmin,
+                hits);
+            for (size_t i = 0; i < RayPacket::SIZE; ++i) {
+                if (hit & (1u << i)) tmax[i] = hits[i].t;
+            }
+            return hit;
+        };
+
+        found |= bvh.intersect_packet(packet, active, tmin, tmax, fn);
+
+        return found;
     }
 };
 
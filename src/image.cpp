@@ -33,9 +33,9 @@ void clamp(float &v, float min, float max)
 
 Image::Image(size_t width, size_t height) : width(width), height(height)
 {
-    rows = new png_bytep[height];
+    rows = new unsigned char *[height];
     for (size_t i = 0; i < height; ++i) {
-        rows[i] = new png_byte[width*3];
+        rows[i] = new unsigned char[width*3];
     }
 }
 
@@ -55,38 +55,19 @@ void Image::set(size_t x, size_t y, float r, float g, float b)
         clamp(g, 0.0, 1.0);
         clamp(b, 0.0, 1.0);
 
-        rows[y][x*3] = (png_byte)(sqrt(r) * 255.0);
-        rows[y][x*3 + 1] = (png_byte)(sqrt(g) * 255.0);
-        rows[y][x*3 + 2] = (png_byte)(sqrt(b) * 255.0);
+        rows[y][x*3] = (unsigned char)(sqrt(r) * 255.0);
+        rows[y][x*3 + 1] = (unsigned char)(sqrt(g) * 255.0);
+        rows[y][x*3 + 2] = (unsigned char)(sqrt(b) * 255.0);
     }
 }
 
-bool Image::save(const char *filename)
+bool Image::save(const char *filename, PngEncoder::Filter filter, int level,
+    size_t nthreads)
 {
-    FILE *f = fopen(filename, "wb");
-    if (!f) {
-        fprintf(stderr, "error: could not open: %s\n", filename);
-        return false;
-    }
-
-    png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, 0, 0, 0);
-    png_infop info = png_create_info_struct(png);
-
-    //set up error handler
-    if (setjmp(png_jmpbuf(png))) {
-        png_destroy_write_struct(&png, &info);
-        fclose(f);
-        fprintf(stderr, "error: could not write png.\n");
-        return false;
-    }
-
-    png_init_io(png, f);
-    png_set_IHDR(png, info, width, height, 8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+    PngEncoder encoder(width, height, filter, level);
+    if (!encoder.open(filename)) return false;
 
-    png_write_info(png, info);
-    png_write_image(png, rows);
-    png_write_end(png, 0);
-    fclose(f);
+    bool ok = encoder.write_image(rows, nthreads);
 
-    return true;
+    return encoder.close() && ok;
 }
@@ -25,7 +25,7 @@ THE SOFTWARE.
 
 #include <cstdlib>
 
-#include <png.h>
+#include "png_encoder.h"
 
 class Image {
 
@@ -35,12 +35,26 @@ public:
     virtual ~Image();
 
     void set(size_t x, size_t y, float r, float g, float b);
-    bool save(const char *filename);
+
+    //rgb bytes of a row, for writing many pixels at once
+    unsigned char *row(size_t y)
+    {
+        return rows[y];
+    }
+
+    /**
+        \param filter The PNG filter applied to each row.
+        \param level The zlib compression level.
+        \param nthreads The number of threads compressing rows.
+    */
+    bool save(const char *filename,
+        PngEncoder::Filter filter = PngEncoder::FILTER_UP, int level = 6,
+        size_t nthreads = 1);
 
 private:
 
     size_t width, height;
-    png_bytep *rows;
+    unsigned char **rows;
 
 };
 
@@ -0,0 +1,135 @@
+/*
+Copyright (c) 2018 Daniel Minor
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include "image_stream.h"
+
+#include <algorithm>
+#include <cstring>
+
+ImageStream::ImageStream(size_t width, size_t height, size_t band_height,
+    PngEncoder::Filter filter, int level)
+    : width(width), height(height), band_height(band_height ? band_height : 1),
+      encoder(width, height, filter, level), is_open(false), next_band(0),
+      peak(0), closing(false), failed(false)
+{
+    nbands = (height + this->band_height - 1)/this->band_height;
+}
+
+ImageStream::~ImageStream()
+{
+    if (is_open) close();
+}
+
+bool ImageStream::open(const char *filename)
+{
+    if (!encoder.open(filename)) return false;
+
+    is_open = true;
+    thread = std::thread(&ImageStream::run, this);
+
+    return true;
+}
+
+void ImageStream::set_span(size_t x, size_t y, size_t count,
+    const unsigned char *rgb)
+{
+    size_t index = y/band_height;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    auto itor = bands.find(index);
+    if (itor == bands.end()) {
+        size_t rows = std::min(band_height, height - index*band_height);
+        Band &band = bands[index];
+        band.data.resize(rows*width*3);
+        band.remaining = rows*width;
+        itor = bands.find(index);
+        peak = std::max(peak, bands.size());
+    }
+
+    Band &band = itor->second;
+    memcpy(&band.data[((y - index*band_height)*width + x)*3], rgb, count*3);
+    band.remaining -= count;
+
+    if (!band.remaining && index == next_band) cv.notify_one();
+}
+
+bool ImageStream::close()
+{
+    if (!is_open) return false;
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        closing = true;
+    }
+    cv.notify_one();
+    thread.join();
+
+    is_open = false;
+
+    return encoder.close() && !failed && next_band == nbands;
+}
+
+void ImageStream::run()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    while (next_band < nbands) {
+        cv.wait(lock, [this] {
+            auto itor = bands.find(next_band);
+            return closing || (itor != bands.end() && !itor->second.remaining);
+        });
+
+        auto itor = bands.find(next_band);
+        if (itor == bands.end() || itor->second.remaining) break;
+
+        //compress without holding the lock so render threads can continue
+        std::vector<unsigned char> data = std::move(itor->second.data);
+        bands.erase(itor);
+        lock.unlock();
+        bool ok = write_band(data);
+        lock.lock();
+
+        if (!ok) {
+            failed = true;
+            break;
+        }
+
+        ++next_band;
+    }
+}
+
+bool ImageStream::write_band(std::vector<unsigned char> &data)
+{
+    size_t rows = data.size()/(width*3);
+    std::vector<const unsigned char *> row_pointers(rows);
+    for (size_t i = 0; i < rows; ++i) {
+        row_pointers[i] = &data[i*width*3];
+    }
+
+    PngEncoder::Segment segment;
+    if (!encoder.compress(&row_pointers[0], rows,
+        next_band ? &above[0] : nullptr, next_band + 1 == nbands, segment)) {
+        return false;
+    }
+    above.assign(row_pointers[rows - 1], row_pointers[rows - 1] + width*3);
+
+    return encoder.write(segment);
+}
@@ -0,0 +1,108 @@
+/*
+Copyright (c) 2018 Daniel Minor
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#ifndef IMAGE_STREAM_H_
+#define IMAGE_STREAM_H_
+
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "png_encoder.h"
+
+/*
+Writes a PNG as the image is rendered rather than once it is complete.
+Rows are grouped into bands, render threads copy finished pixels into the
+band they belong to and a writer thread compresses each band as soon as
+it and every band above it are complete. Only bands which are partially
+rendered or waiting on an earlier band are held in memory.
+*/
+class ImageStream {
+
+public:
+
+    /**
+        \param band_height The number of rows per band, usually the tile
+                           size so that a row of tiles completes a band.
+        \param filter The PNG filter applied to each row.
+        \param level The zlib compression level.
+    */
+    ImageStream(size_t width, size_t height, size_t band_height,
+        PngEncoder::Filter filter = PngEncoder::FILTER_UP, int level = 6);
+
+    //closes the stream if it is still open
+    virtual ~ImageStream();
+
+    bool open(const char *filename);
+
+    /**
+        Copies part of a row of the image, may be called from any thread.
+
+        \param x The first pixel of the span.
+        \param y The row.
+        \param count The number of pixels in the span.
+        \param rgb The pixels, three bytes each.
+    */
+    void set_span(size_t x, size_t y, size_t count, const unsigned char *rgb);
+
+    //waits for the remaining bands and finishes the file, returns false
+    //if any pixels were missing or writing failed
+    bool close();
+
+    //largest number of bands held at once
+    size_t peak_bands() const
+    {
+        return peak;
+    }
+
+private:
+
+    struct Band {
+        std::vector<unsigned char> data;
+        size_t remaining;       //pixels not yet set
+    };
+
+    size_t width, height, band_height;
+    size_t nbands;
+
+    PngEncoder encoder;
+    bool is_open;
+    std::vector<unsigned char> above;   //last row written, for filtering
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::map<size_t, Band> bands;   //reorder buffer, by band index
+    size_t next_band;               //next band to be written
+    size_t peak;
+    bool closing;
+    bool failed;
+    std::thread thread;
+
+    void run();
+    bool write_band(std::vector<unsigned char> &data);
+};
+
+#endif
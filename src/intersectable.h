@@ -23,27 +23,180 @@ THE SOFTWARE.
 #ifndef INTERSECTABLE_H_
 #define INTERSECTABLE_H_
 
+#include <limits>
 #include <memory>
 
+#include "bounding_box.h"
 #include "material.h"
 #include "ray.h"
+#include "ray_packet.h"
+#include "sampler.h"
 #include "vec.h"
 
 const double INTERSECTION_EPSILON = 0.00001;
 
+struct Intersectable;
+
+/*
+Record of the closest hit found so far. Traversal only tracks the distance
+along the ray and which primitive was hit, the point, normal and material
+are computed once by surface() when traversal is complete.
+*/
+struct Hit {
+
+    //maximum depth of nested transforms above a primitive
+    static const int MAX_INSTANCES = 8;
+
+    double t;                   //maximum distance on entry, hit distance after
+    const Intersectable *object;
+    size_t id;                  //primitive within the object, e.g. mesh face
+    double u, v;                //barycentric coordinates on triangles
+
+    //transforms above the object, innermost first
+    const Intersectable *instances[MAX_INSTANCES];
+    int ninstances;
+
+    Hit() : t(std::numeric_limits<double>::max()), object(nullptr), id(0),
+        u(0.0), v(0.0), ninstances(0)
+    {
+    }
+
+    explicit Hit(double tmax) : t(tmax), object(nullptr), id(0),
+        u(0.0), v(0.0), ninstances(0)
+    {
+    }
+
+    //called by primitives when they find a closer hit
+    void set(double t, const Intersectable *object, size_t id = 0,
+        double u = 0.0, double v = 0.0)
+    {
+        this->t = t;
+        this->object = object;
+        this->id = id;
+        this->u = u;
+        this->v = v;
+        ninstances = 0;
+    }
+
+    void surface(const Ray &ray, Vec &pt, Vec &norm, Material *&mat) const;
+};
+
 struct Intersectable {
 
     std::unique_ptr<Material> material;
 
     Intersectable() : material(nullptr) {};
 
-    virtual Ray emit()
+    virtual ~Intersectable() {};
+
+    //starts a photon path at a point on the surface, returns false if the
+    //object cannot emit photons. The point is chosen using the pixel
+    //dimensions of the sample and the direction using the lens dimensions.
+    virtual bool emit(Sampler &sampler, Ray &ray) const
+    {
+        return false;
+    }
+
+    //area photons are emitted from, counting both sides of surfaces which
+    //emit from both sides
+    virtual double emitting_area() const
     {
-        return Ray();
+        return 0.0;
     }
 
-    virtual bool intersect(const Ray &ray, double tmin, double tmax,
-        Vec &pt, Vec &norm, Material *&mat) const = 0;
+    //cosine weighted direction about the normal n, for emission
+    static Vec emit_direction(Sampler &sampler, const Vec &n)
+    {
+        double u1, u2;
+        sampler.get_2d(Sampler::LENS_U, u1, u2);
+        Vec w = Vec::sample_hemisphere_cosine_weighted(u1, u2);
+
+        Vec u, v;
+        n.construct_basis(u, v);
+        Vec direction = u*w.x + v*w.y + n*w.z;
+        direction.normalize();
+        return direction;
+    }
+
+    //returns false if the object is unbounded, e.g. a plane
+    virtual bool bounds(BoundingBox &box) const
+    {
+        return false;
+    }
+
+    //closest hit query, returns true and updates hit if there is a hit
+    //between tmin and hit.t
+    virtual bool intersect(const Ray &ray, double tmin, Hit &hit) const = 0;
+
+    //computes the point, normal and material for a hit on this primitive,
+    //the ray is in the primitive's frame
+    virtual void surface(const Ray &ray, const Hit &hit, Vec &pt, Vec &norm,
+        Material *&mat) const
+    {
+        pt = ray.origin + ray.direction*hit.t;
+        mat = material.get();
+    }
+
+    //used by instancing nodes to move rays into their child's frame and
+    //surface data back out of it
+    virtual void to_local(Ray &ray) const
+    {
+    }
+
+    virtual void to_world(Vec &pt, Vec &norm, Material *&mat) const
+    {
+    }
+
+    bool intersect(const Ray &ray, double tmin, double tmax,
+        Vec &pt, Vec &norm, Material *&mat) const
+    {
+        Hit hit(tmax);
+        if (!intersect(ray, tmin, hit)) return false;
+
+        hit.surface(ray, pt, norm, mat);
+        return true;
+    }
+
+    //any hit query, returns as soon as a hit is found between tmin and tmax
+    virtual bool occluded(const Ray &ray, double tmin, double tmax) const
+    {
+        Hit hit(tmax);
+        return intersect(ray, tmin, hit);
+    }
+
+    /*
+    Intersects the rays of a packet selected by the active mask, returning
+    the mask of rays which hit. hits[i].t holds the maximum distance for
+    each ray and hits are updated for those which hit.
+    */
+    virtual unsigned intersect_packet(const RayPacket &packet, unsigned active,
+        double tmin, Hit *hits) const
+    {
+        unsigned result = 0;
+        for (int i = 0; i < RayPacket::SIZE; ++i) {
+            if (!(active & (1u << i))) continue;
+
+            if (intersect(packet.rays[i], tmin, hits[i])) {
+                result |= 1u << i;
+            }
+        }
+
+        return result;
+    }
 };
 
+inline void Hit::surface(const Ray &ray, Vec &pt, Vec &norm, Material *&mat) const
+{
+    Ray local = ray;
+    for (int i = ninstances - 1; i >= 0; --i) {
+        instances[i]->to_local(local);
+    }
+
+    object->surface(local, *this, pt, norm, mat);
+
+    for (int i = 0; i < ninstances; ++i) {
+        instances[i]->to_world(pt, norm, mat);
+    }
+}
+
 #endif
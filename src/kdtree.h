@@ -24,11 +24,16 @@ THE SOFTWARE.
 #define KD_TREE_H_
 
 #include <cmath>
+#include <cstdint>
 #include <cstdlib>
 #include <cstdio>
 
+#include <algorithm>
+#include <atomic>
 #include <limits>
 #include <list>
+#include <memory>
+#include <thread>
 #include <vector>
 
 #include <sys/mman.h>
@@ -40,33 +45,83 @@ template<class Point, class Number> class KdTree {
 
 public:
 
+    //nodes refer to points and children by index and offset rather than
+    //by pointer, so the arena can be written to a file and mapped back
     struct Node {
-        Point *pt;
         Number median;
-        Node *children;
+        uint32_t point;         //index of the point stored at this node
+        uint32_t children;      //offset of the right child, LEFT_CHILD is
+                                //set if there is a left child
         int axis;
 
+        static const uint32_t LEFT_CHILD = 0x80000000;
+
         inline Node *left()
         {
-            return (long)children & 0xA0000000 ? this + 1 : 0;
+            return children & LEFT_CHILD ? this + 1 : 0;
         }
 
         inline Node *right()
         {
-            Node *n = this + ((long)children & ~0xA0000000);
+            Node *n = this + (children & ~LEFT_CHILD);
+            return this == n ? 0 : n;
+        }
+
+        inline const Node *left() const
+        {
+            return children & LEFT_CHILD ? this + 1 : 0;
+        }
+
+        inline const Node *right() const
+        {
+            const Node *n = this + (children & ~LEFT_CHILD);
             return this == n ? 0 : n;
         }
     };
 
-    KdTree(size_t dim, Point *pts, size_t n)
+    //a point found by a query and its squared distance from the query point
+    struct Neighbour {
+        Point *pt;
+        Number distance;
+    };
+
+    //working space for queries. Each thread querying the tree needs its
+    //own, it is reused between queries so that they do not allocate.
+    struct Scratch {
+        //branches still to be searched and the squared distance from the
+        //query point to their splitting plane
+        std::vector<std::pair<const Node *, Number> > stack;
+
+        //the box searched by range() and the region of the current subtree,
+        //the lower then upper bound of each dimension
+        std::vector<Number> box;
+        std::vector<Number> region;
+    };
+
+    /** Builds a kd-tree over the points, reordering them in place.
+
+        \param dim The number of dimensions.
+        \param pts The points.
+        \param n The number of points.
+        \param nthreads The number of threads used to build the tree, the
+                        arena layout does not depend on this.
+    */
+    KdTree(size_t dim, Point *pts, size_t n, size_t nthreads = 1)
         : dim(dim)
         , arena(0)
+        , owns_arena(true)
         , searchpq(std::max(32, (int)log(n)))
     {
         arena = (Node *)mmap(0, n*sizeof(Node), PROT_READ|PROT_WRITE,
             MAP_PRIVATE|MAP_ANON, -1, 0);
-        arena_offset = 0;
-        root = build_kdtree(pts, n, 0);
+        arena_offset = n;
+
+        //space for partitioning, subtrees use the part matching their points
+        if (nthreads > 1 && n > PARALLEL_PARTITION_MIN) scratch.reset(new Point[n]);
+        points = pts;
+        root = build_kdtree(pts, n, 0, arena, nthreads ? nthreads : 1);
+        scratch.reset();
+
         this->n = n;
     }
 
@@ -77,20 +132,52 @@ public:
         }
     };
 
-    KdTree(size_t dim, Point *pts, size_t n, Number *range, EndBuildFn &fn) : dim(dim), arena(0)
+    KdTree(size_t dim, Point *pts, size_t n, Number *range, EndBuildFn &fn) : dim(dim), arena(0), owns_arena(true)
     {
         arena = (Node *)mmap(0, n*sizeof(Node), PROT_READ|PROT_WRITE,
             MAP_PRIVATE|MAP_ANON, -1, 0);
         arena_offset = 0;
+        points = pts;
 
         root = build_kdtree(pts, n, 0, range, fn);
 
         this->n = n;
     }
 
+    /** Uses nodes previously built over the points, such as nodes mapped
+        from a file. The nodes are not copied and must outlive the tree.
+
+        \param dim The number of dimensions.
+        \param pts The points, in the order left by the build.
+        \param n The number of points.
+        \param nodes The n nodes of the tree.
+    */
+    KdTree(size_t dim, Point *pts, size_t n, const Node *nodes)
+        : n(n)
+        , dim(dim)
+        , arena(const_cast<Node *>(nodes))
+        , arena_offset(n)
+        , owns_arena(false)
+        , points(pts)
+        , searchpq(std::max(32, (int)log(n)))
+    {
+        root = n ? arena : 0;
+    }
+
     virtual ~KdTree()
     {
-        if (arena) munmap(arena, n*sizeof(Node));
+        if (arena && owns_arena) munmap(arena, n*sizeof(Node));
+    }
+
+    //the node arena, n nodes with the root first
+    const Node *nodes() const
+    {
+        return arena;
+    }
+
+    Point *point(const Node *node) const
+    {
+        return points + node->point;
     }
 
     /** This function searches for the k nearest neighbours to a query point.
@@ -110,7 +197,7 @@ public:
         std::list<std::pair<Point *, Number> > qr;
         while(pq.length) {
             typename FixedSizePriorityQueue<Node *>::Entry e = pq.pop();
-            qr.push_front(std::make_pair(e.data->pt, e.priority));
+            qr.push_front(std::make_pair(point(e.data), e.priority));
         }
 
         return qr;
@@ -135,12 +222,169 @@ public:
         std::list<std::pair<Point *, Number> > qr;
         while(pq.length) {
             typename FixedSizePriorityQueue<Node *>::Entry e = pq.pop();
-            qr.push_front(std::make_pair(e.data->pt, e.priority));
+            qr.push_front(std::make_pair(point(e.data), e.priority));
         }
 
         return qr;
     }
 
+    /** This function searches for the k nearest neighbours to a query point
+        without modifying the tree, so it may be called from several threads
+        at once provided each has its own scratch space.
+
+        \param pt The point for which to find the nearest neighbours.
+        \param k The number of nearest neighbours to find.
+        \param eps The epsilon for approximate nearest neighbour searches.
+        \param scratch Working space for the search.
+        \param result Space for k neighbours, receives the neighbours found
+                      ordered from nearest to farthest.
+        \return The number of neighbours found, less than k only if the tree
+                has fewer than k points.
+    */
+    size_t knn(const Point &pt, size_t k, Number eps, Scratch &scratch,
+        Neighbour *result) const
+    {
+        return knn(pt, k, std::numeric_limits<Number>::infinity(), eps,
+            scratch, result);
+    }
+
+    /** This function searches for the k nearest neighbours to a query point
+        which are within a radius of it, as knn() above.
+
+        \param pt The point for which to find the nearest neighbours.
+        \param k The number of nearest neighbours to find.
+        \param radius Neighbours farther than this from pt are not found.
+        \param eps The epsilon for approximate nearest neighbour searches.
+        \param scratch Working space for the search.
+        \param result Space for k neighbours, receives the neighbours found
+                      ordered from nearest to farthest.
+        \return The number of neighbours found, less than k if there are
+                fewer than k points within the radius.
+    */
+    size_t knn(const Point &pt, size_t k, Number radius, Number eps,
+        Scratch &scratch, Neighbour *result) const
+    {
+        if (!k || !root) return 0;
+
+        //result is a max heap on distance until the search is complete, so
+        //the farthest neighbour found so far is result[0]. Points on the
+        //radius are found, so a branch is only skipped if it is beyond the
+        //radius or no closer than result[0] once there are k neighbours.
+        size_t count = 0;
+        Number scale = (1.0 + eps)*(1.0 + eps);
+        Number radius2 = radius*radius;
+        auto prune = [&](Number plane_distance) {
+            return plane_distance > radius2
+                || (count == k && plane_distance >= result[0].distance);
+        };
+        scratch.stack.clear();
+        scratch.stack.push_back(std::make_pair((const Node *)root, (Number)0));
+
+        while (!scratch.stack.empty()) {
+            const Node *node = scratch.stack.back().first;
+            Number plane_distance = scratch.stack.back().second;
+            scratch.stack.pop_back();
+
+            if (prune(plane_distance*scale)) continue;
+
+            while (node) {
+                Number distance = 0;
+                for (size_t i = 0; i < dim; ++i) {
+                    Number d = points[node->point][i] - pt[i];
+                    distance += d*d;
+                }
+
+                if (distance > radius2) {
+                    //outside the radius
+                } else if (count < k) {
+                    result[count].pt = point(node);
+                    result[count].distance = distance;
+                    sift_up(result, count++);
+                } else if (distance < result[0].distance) {
+                    result[0].pt = point(node);
+                    result[0].distance = distance;
+                    sift_down(result, 0, count);
+                }
+
+                if (!node->children) break;
+
+                //continue down the near side, the far side is searched later
+                //if it could still hold a closer point
+                Number d = pt[node->axis] - node->median;
+                const Node *far = d < 0 ? node->right() : node->left();
+                if (far && !prune(d*d*scale)) {
+                    scratch.stack.push_back(std::make_pair(far, d*d));
+                }
+
+                node = d < 0 ? node->left() : node->right();
+            }
+        }
+
+        //sort the heap from nearest to farthest
+        for (size_t n = count; n > 1; --n) {
+            std::swap(result[0], result[n - 1]);
+            sift_down(result, 0, n - 1);
+        }
+
+        return count;
+    }
+
+    /** This function finds every point within a radius of a query point
+        without modifying the tree.
+
+        \param pt The query point.
+        \param radius The radius to search, points on it are found.
+        \param scratch Working space for the search.
+        \param fn Called as fn(Point *, Number) for each point found, with
+                  its squared distance from pt, in no particular order.
+        \return The number of points found.
+    */
+    template<class Fn> size_t range(const Point &pt, Number radius,
+        Scratch &scratch, Fn fn) const
+    {
+        if (!root) return 0;
+
+        //the points are first tested against the box around the sphere,
+        //subtrees whose regions miss the box are skipped
+        std::vector<Number> &box = scratch.box;
+        std::vector<Number> &region = scratch.region;
+        box.resize(2*dim);
+        region.resize(2*dim);
+        for (size_t i = 0; i < dim; ++i) {
+            box[i*2] = pt[i] - radius;
+            box[i*2+1] = pt[i] + radius;
+            region[i*2] = -std::numeric_limits<Number>::infinity();
+            region[i*2+1] = std::numeric_limits<Number>::infinity();
+        }
+
+        return range(root, pt, radius*radius, &box[0], &region[0], fn);
+    }
+
+    /** This function finds every point inside an axis aligned box without
+        modifying the tree.
+
+        \param box The lower then upper bound of each dimension.
+        \param scratch Working space for the search.
+        \param qr Receives the points found, in no particular order.
+        \return The number of points found.
+    */
+    size_t range(const Number *box, Scratch &scratch,
+        std::vector<Point *> &qr) const
+    {
+        if (!root) return 0;
+
+        std::vector<Number> &region = scratch.region;
+        region.resize(2*dim);
+        for (size_t i = 0; i < dim; ++i) {
+            region[i*2] = -std::numeric_limits<Number>::infinity();
+            region[i*2+1] = std::numeric_limits<Number>::infinity();
+        }
+
+        size_t count = qr.size();
+        range(root, box, &region[0], qr);
+        return qr.size() - count;
+    }
+
     /** This function searches for a single exact nearest neighbour and returns
         the Node containing it.  This is useful for building caches on top of
         the kd-tree.
@@ -197,10 +441,29 @@ private:
 
     Node *arena;
     size_t arena_offset;
+    bool owns_arena;
+
+    Point *points;
+    std::unique_ptr<Point[]> scratch;
 
     PriorityQueue<Node *> searchpq;
 
-    Node *build_kdtree(Point *pts, size_t pt_count, size_t depth)
+    //subtrees with at least this many points are built on a separate thread
+    //when there are threads to spare
+    static const size_t PARALLEL_BUILD_MIN = 1 << 12;
+
+    //when building with several threads, ranges with at least this many
+    //points are partitioned in blocks of PARTITION_BLOCK points spread over
+    //the threads
+    static const size_t PARALLEL_PARTITION_MIN = 1 << 18;
+    static const size_t PARTITION_BLOCK = 1 << 14;
+
+    //a subtree over m points has exactly m nodes laid out in preorder, so
+    //the left child of a node is the next node and the right child follows
+    //the left subtree. Subtrees can be built on any thread and the arena
+    //layout is the same as a sequential build.
+    Node *build_kdtree(Point *pts, size_t pt_count, size_t depth, Node *node,
+        size_t nthreads)
     {
         Node *result = 0;
 
@@ -208,41 +471,57 @@ private:
             //empty branch
         } else if (pt_count == 1) {
             //leaf node, store point and return
-            result = new (arena + arena_offset) Node;
-            ++arena_offset;
-            result->pt = pts;
+            result = new (node) Node;
+            result->point = pts - points;
             result->median = 0;
             result->children = 0;
         } else {
 
-            result = new (arena + arena_offset) Node;
-            ++arena_offset;
+            result = new (node) Node;
 
             //branch coordinate
             result->axis = depth % dim;
 
             //find median (has side effect of partitioning input array around median)
             size_t median_index = (pt_count / 2) >> 1 << 1;
-            Number median = select_order(median_index, pts, pt_count, result->axis);
+            Number median = select_order(median_index, pts, pt_count,
+                result->axis, nthreads);
 
-            //recursively build tree
+            //recursively build tree, the threads are shared between the
+            //subtrees
             result->children = 0;
-            Node *left = build_kdtree(pts, median_index, depth + 1);
-            Node *right = build_kdtree(&pts[median_index + 1],
-                pt_count - median_index - 1, depth + 1);
+            Node *left = 0;
+            Node *right = 0;
+            Node *left_node = node + 1;
+            Node *right_node = node + 1 + median_index;
+            Point *right_pts = &pts[median_index + 1];
+            size_t right_count = pt_count - median_index - 1;
+            if (nthreads > 1 && pt_count >= PARALLEL_BUILD_MIN) {
+                size_t left_threads = nthreads/2;
+                std::thread thread([&] {
+                    left = build_kdtree(pts, median_index, depth + 1,
+                        left_node, left_threads);
+                });
+                right = build_kdtree(right_pts, right_count, depth + 1,
+                    right_node, nthreads - left_threads);
+                thread.join();
+            } else {
+                left = build_kdtree(pts, median_index, depth + 1, left_node, 1);
+                right = build_kdtree(right_pts, right_count, depth + 1,
+                    right_node, 1);
+            }
 
-            result->children = (Node *)(right - result);
-            if (left) result->children = (Node *)((long)result->children | 0xA0000000);
+            result->children = right - result;
+            if (left) result->children |= Node::LEFT_CHILD;
 
             //store point and median value
-            result->pt = &pts[median_index];
+            result->point = &pts[median_index] - points;
             result->median = median;
         }
 
         return result;
     }
 
-
     Node *build_kdtree(Point *pts, size_t pt_count, size_t depth,
         Number *range, EndBuildFn &fn)
     {
@@ -254,7 +533,7 @@ private:
             //leaf node, store point and return
             result = new (arena + arena_offset) Node;
             ++arena_offset;
-            result->pt = pts;
+            result->point = pts - points;
             result->median = 0;
             result->children = 0;
             fn(result, range);
@@ -271,7 +550,7 @@ private:
             Number median = select_order(median_index, pts, pt_count, result->axis);
 
             //store point and median value
-            result->pt = &pts[median_index];
+            result->point = &pts[median_index] - points;
             result->median = median;
             result->children = 0;
 
@@ -291,8 +570,8 @@ private:
                     pt_count - median_index - 1, depth + 1, range, fn);
                 range[range_coord] = t;
 
-                result->children = (Node *)(right - result);
-                if (left) result->children = (Node *)((long)result->children | 0xA0000000);
+                result->children = right - result;
+                if (left) result->children |= Node::LEFT_CHILD;
             }
 
         }
@@ -302,8 +581,9 @@ private:
 
     size_t partition(size_t start, size_t end, Point *pts, size_t coord)
     {
-        //choose pivot and place at end
-        size_t pivot = start + rand() % (end - start);
+        //choose pivot and place at end, the middle element is used rather
+        //than a random one so that builds are reproducible
+        size_t pivot = start + (end - start)/2;
         std::swap(pts[pivot], pts[end]);
 
         //move values around pivot
@@ -320,7 +600,96 @@ private:
         return i;
     }
 
-    Number select_order(size_t i, Point *pts, size_t pt_count, size_t coord)
+    //stable partition of [start, end] around the middle element, elements
+    //are counted and then scattered a block at a time. This only differs
+    //from partition() in the order within each side, so the tree is the
+    //same as a single threaded build apart from the order of points with
+    //identical coordinates.
+    size_t partition_blocks(size_t start, size_t end, Point *pts, size_t coord,
+        size_t nthreads)
+    {
+        size_t pivot = start + (end - start)/2;
+        std::swap(pts[pivot], pts[end]);
+
+        size_t count = end - start;
+        size_t nblocks = (count + PARTITION_BLOCK - 1)/PARTITION_BLOCK;
+        auto block_end = [&](size_t block) {
+            return std::min(start + (block + 1)*PARTITION_BLOCK, end);
+        };
+
+        //comparisons are made once and remembered for the scatter
+        std::vector<size_t> less(nblocks);
+        std::vector<char> is_less(count);
+        parallel_for(nblocks, nthreads, [&](size_t block) {
+            size_t n = 0;
+            for (size_t j = start + block*PARTITION_BLOCK; j < block_end(block); ++j) {
+                is_less[j - start] = pt_lt(coord, pts[j], pts[end]);
+                n += is_less[j - start];
+            }
+            less[block] = n;
+        });
+
+        //where each block's elements go in the partitioned range
+        std::vector<size_t> less_offset(nblocks);
+        std::vector<size_t> greater_offset(nblocks);
+        size_t nless = 0;
+        for (size_t block = 0; block < nblocks; ++block) nless += less[block];
+        size_t lt = 0;
+        size_t ge = nless;
+        for (size_t block = 0; block < nblocks; ++block) {
+            less_offset[block] = lt;
+            greater_offset[block] = ge;
+            lt += less[block];
+            ge += block_end(block) - start - block*PARTITION_BLOCK - less[block];
+        }
+
+        Point *partitioned = &scratch[pts + start - points];
+        parallel_for(nblocks, nthreads, [&](size_t block) {
+            size_t lt = less_offset[block];
+            size_t ge = greater_offset[block];
+            for (size_t j = start + block*PARTITION_BLOCK; j < block_end(block); ++j) {
+                if (is_less[j - start]) {
+                    partitioned[lt++] = pts[j];
+                } else {
+                    partitioned[ge++] = pts[j];
+                }
+            }
+        });
+
+        parallel_for(nblocks, nthreads, [&](size_t block) {
+            size_t first = block*PARTITION_BLOCK;
+            std::copy(partitioned + first, partitioned + block_end(block) - start,
+                &pts[start + first]);
+        });
+
+        size_t i = start + nless;
+        std::swap(pts[i], pts[end]);
+
+        return i;
+    }
+
+    //calls fn(i) for i in [0, count), spread over nthreads threads
+    template<class Fn> static void parallel_for(size_t count, size_t nthreads,
+        Fn fn)
+    {
+        std::atomic<size_t> next(0);
+        auto worker = [&]() {
+            for (size_t i = next++; i < count; i = next++) fn(i);
+        };
+
+        std::vector<std::thread> threads;
+        for (size_t i = 1; i < nthreads && i < count; ++i) {
+            threads.push_back(std::thread(worker));
+        }
+        worker();
+
+        for (auto& thread : threads) {
+            thread.join();
+        }
+    }
+
+    Number select_order(size_t i, Point *pts, size_t pt_count, size_t coord,
+        size_t nthreads = 1)
     {
         size_t start = 0;
         size_t end = pt_count - 1;
@@ -329,7 +698,9 @@ private:
 
             if (start == end) return pts[start][coord];
 
-            size_t pivot = partition(start, end, pts, coord);
+            size_t pivot = nthreads > 1 && end - start >= PARALLEL_PARTITION_MIN
+                ? partition_blocks(start, end, pts, coord, nthreads)
+                : partition(start, end, pts, coord);
 
             if (i == pivot) {
                 return pts[pivot][coord];
@@ -354,46 +725,122 @@ private:
         }
     }
 
-    int point_in_range(Point *p, Number *range)
+    //ranges and regions are the lower then upper bound of each dimension,
+    //the region of a subtree is bounded by the medians of its ancestors
+    int point_in_range(const Point *p, const Number *range) const
     {
-        for (int i = 0; i < dim; ++i) {
+        for (size_t i = 0; i < dim; ++i) {
             if (range[i*2] > (*p)[i] || range[i*2+1] < (*p)[i]) return 0;
         }
 
         return 1;
     }
 
-    int range_contains_region(Number *range, Number *region)
+    int range_contains_region(const Number *range, const Number *region) const
     {
-        for (int i = 0; i < dim; ++i) {
+        for (size_t i = 0; i < dim; ++i) {
             if (range[i*2] > region[i*2] || range[i*2+1] < region[i*2+1]) return 0;
+        }
+
+        return 1;
+    }
+
+    int region_intersects_range(const Number *range, const Number *region) const
+    {
+        for (size_t i = 0; i < dim; ++i) {
             if (range[i*2] > region[i*2+1] || range[i*2+1] < region[i*2]) return 0;
         }
 
         return 1;
     }
 
-    int region_intersects_range(Number *range, Number *region)
+    template<class Fn> size_t range(const Node *node, const Point &pt,
+        Number radius2, const Number *box, Number *region, Fn &fn) const
+    {
+        size_t count = 0;
+        if (point_in_range(point(node), box)) {
+            Number distance = 0;
+            for (size_t i = 0; i < dim; ++i) {
+                Number d = points[node->point][i] - pt[i];
+                distance += d*d;
+            }
+
+            if (distance <= radius2) {
+                fn(point(node), distance);
+                ++count;
+            }
+        }
+
+        if (!node->children) return count;
+
+        //the left subtree is below the median on the node's axis and the
+        //right subtree above it
+        size_t lo = node->axis*2;
+        size_t hi = lo + 1;
+        if (node->left()) {
+            Number t = region[hi];
+            region[hi] = node->median;
+            if (region_intersects_range(box, region)) {
+                count += range(node->left(), pt, radius2, box, region, fn);
+            }
+            region[hi] = t;
+        }
+
+        if (node->right()) {
+            Number t = region[lo];
+            region[lo] = node->median;
+            if (region_intersects_range(box, region)) {
+                count += range(node->right(), pt, radius2, box, region, fn);
+            }
+            region[lo] = t;
+        }
+
+        return count;
+    }
+
+    void range(const Node *node, const Number *box, Number *region,
+        std::vector<Point *> &qr) const
     {
-        int intersects = 0;
-        for (int i = 0; i < dim; ++i) {
-            if (range[i*2] < region[i*2] || range[i*2+1] > region[i*2+1]) intersects = 1;
-            if (range[i*2] < region[i*2+1] || range[i*2+1] > region[i*2]) intersects = 1;
+        //subtrees inside the box are reported without testing each point
+        if (range_contains_region(box, region)) {
+            report_subtree(node, qr);
+            return;
         }
 
-        return intersects;
+        if (point_in_range(point(node), box)) qr.push_back(point(node));
+        if (!node->children) return;
+
+        size_t lo = node->axis*2;
+        size_t hi = lo + 1;
+        if (node->left()) {
+            Number t = region[hi];
+            region[hi] = node->median;
+            if (region_intersects_range(box, region)) {
+                range(node->left(), box, region, qr);
+            }
+            region[hi] = t;
+        }
+
+        if (node->right()) {
+            Number t = region[lo];
+            region[lo] = node->median;
+            if (region_intersects_range(box, region)) {
+                range(node->right(), box, region, qr);
+            }
+            region[lo] = t;
+        }
     }
 
-    void report_subtree(Node *tree, std::vector<Point *> &qr)
+    void report_subtree(const Node *tree, std::vector<Point *> &qr) const
     {
-        qr.push_back(tree->pt);
+        qr.push_back(point(tree));
 
         //recurse through tree
         if (tree->left()) report_subtree(tree->left(), qr);
         if (tree->right()) report_subtree(tree->right(), qr);
     }
 
-    size_t report_subtree(Node *tree)
+    size_t report_subtree(const Node *tree) const
     {
         size_t result = 1;
 
@@ -404,6 +851,29 @@ private:
         return result;
     }
 
+    static void sift_up(Neighbour *heap, size_t i)
+    {
+        while (i && heap[(i - 1)/2].distance < heap[i].distance) {
+            std::swap(heap[(i - 1)/2], heap[i]);
+            i = (i - 1)/2;
+        }
+    }
+
+    static void sift_down(Neighbour *heap, size_t i, size_t length)
+    {
+        while (1) {
+            size_t largest = i;
+            size_t l = 2*i + 1;
+            size_t r = l + 1;
+            if (l < length && heap[l].distance > heap[largest].distance) largest = l;
+            if (r < length && heap[r].distance > heap[largest].distance) largest = r;
+            if (largest == i) return;
+
+            std::swap(heap[i], heap[largest]);
+            i = largest;
+        }
+    }
+
     void knn_search(FixedSizePriorityQueue<Node *> &resultpq,
         const Point &pt, Number eps)
     {
@@ -430,7 +900,7 @@ private:
                     //calculate distance from query point to this point
                     Number distance = 0;
                     for (size_t i = 0; i < dim; ++i) {
-                        distance += ((*(node->pt))[i]-pt[i]) * ((*(node->pt))[i]-pt[i]);
+                        distance += (points[node->point][i]-pt[i]) * (points[node->point][i]-pt[i]);
                     }
 
                     if (!resultpq.full() || distance < resultpq.peek().priority) {
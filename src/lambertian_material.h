@@ -37,13 +37,39 @@ struct LambertianMaterial : public Material {
 
     virtual ~LambertianMaterial() {};
 
-    virtual bool isLambertian()
+    virtual bool isLambertian() const
     {
         return true;
     }
 
+    //true if the photon map gives the light arriving from other surfaces
+    //at a hit by the incident ray, at the first lambertian hit or at the
+    //second with final gathering
+    static bool uses_photon_map(const Scene &scene, const Ray &incident)
+    {
+        return scene.use_photon_map
+            && incident.depth >= (scene.final_gather ? 1 : 0);
+    }
+
     void shade(const Scene &scene, const Ray &incident, const Vec &pt,
-        const Vec &norm, float &r, float &g, float &b) const override
+        const Vec &norm, Sampler &sampler, float &r, float &g, float &b) const override
+    {
+        float er = 0.0f, eg = 0.0f, eb = 0.0f;
+        if (uses_photon_map(scene, incident)) {
+            scene.photon_map.query(pt, norm, scene.query_photons, 0.0, er, eg, eb);
+        }
+
+        shade(scene, incident, pt, norm, sampler, er, eg, eb, r, g, b);
+    }
+
+    /** Shades with the irradiance from the photon map at pt already found,
+        so that the queries for a packet of hits can be made together.
+
+        \param er, eg, eb The irradiance, only used if uses_photon_map().
+    */
+    void shade(const Scene &scene, const Ray &incident, const Vec &pt,
+        const Vec &norm, Sampler &sampler, float er, float eg, float eb,
+        float &r, float &g, float &b) const
     {
         Ray ray;
         ray.depth = incident.depth + 1;
@@ -58,10 +84,35 @@ struct LambertianMaterial : public Material {
 
         Vec u, v;
         norm.construct_basis(u, v);
-        Vec w = Vec::sample_hemisphere_cosine_weighted();
+        double u1, u2;
+        sampler.get_2d(Sampler::bounce_dimension(incident.depth,
+            Sampler::DIRECTION_U), u1, u2);
+        Vec w = Vec::sample_hemisphere_cosine_weighted(u1, u2);
         ray.direction = u*w.x + v*w.y + norm*w.z;
         ray.direction.normalize();
 
+        //the photon map ends the path, the bounce then only picks up direct
+        //light
+        if (uses_photon_map(scene, incident)) {
+            float dr = scene.r, dg = scene.g, db = scene.b;
+            Vec ipt;
+            Vec inorm;
+            Material *material;
+            if (scene.intersect(ray, 0.001, std::numeric_limits<double>::max(),
+                                ipt, inorm, material)) {
+                dr = dg = db = 0.0f;
+                if (material && material->isDiffuse() && !scene.photon_map_direct) {
+                    material->shade(scene, ray, ipt, inorm, sampler, dr, dg, db);
+                }
+            }
+
+            //irradiance from the map is divided by pi for the lambertian brdf
+            r = this->r*reflectivity*(dr + er/pi);
+            g = this->g*reflectivity*(dg + eg/pi);
+            b = this->b*reflectivity*(db + eb/pi);
+            return;
+        }
+
         Vec ipt;
         Vec inorm;
         float ir, ig, ib;
@@ -72,7 +123,7 @@ struct LambertianMaterial : public Material {
         if (scene.intersect(ray, 0.001, std::numeric_limits<double>::max(),
                             ipt, inorm, material)) {
             if (material) {
-                material->shade(scene, ray, ipt, inorm, ir, ig, ib);
+                material->shade(scene, ray, ipt, inorm, sampler, ir, ig, ib);
             }
         }
 
@@ -24,6 +24,7 @@ THE SOFTWARE.
 #define MATERIAL_H_
 
 #include "ray.h"
+#include "sampler.h"
 #include "vec.h"
 
 struct Scene;
@@ -43,7 +44,8 @@ struct Material {
     }
 
     virtual void shade(const Scene &scene, const Ray &incident,
-        const Vec &pt, const Vec &norm, float &r, float &g, float &b) const = 0;
+        const Vec &pt, const Vec &norm, Sampler &sampler, float &r,
+        float &g, float &b) const = 0;
 };
 
 #endif
@@ -20,25 +20,170 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
 THE SOFTWARE.
 */
 
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
 #include <cstdio>
+#include <cstring>
+#include <thread>
+#include <vector>
 
 #include "material.h"
 #include "diffuse_material.h"
 #include "lambertian_material.h"
 #include "photon_map.h"
 #include "ray.h"
+#include "sampler.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+//photon map files start with this header, the photon array follows at a
+//page aligned offset so it can be used from the mapping
+struct FileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t photon_size;
+    uint32_t direct_lighting;
+    uint64_t nphotons;
+    uint64_t number_emitted;
+    uint64_t photon_offset;
+};
+
+const char FILE_MAGIC[8] = {'R', 'T', 'P', 'M', 'A', 'P', '\r', '\n'};
+const uint32_t FILE_VERSION = 4;
+const uint32_t FILE_BYTE_ORDER = 0x01020304;
+const uint64_t FILE_ALIGNMENT = 4096;
+
+uint64_t align(uint64_t offset)
+{
+    return (offset + FILE_ALIGNMENT - 1)/FILE_ALIGNMENT*FILE_ALIGNMENT;
+}
+
+bool pad(FILE *f, uint64_t offset)
+{
+    long pos = ftell(f);
+    if (pos < 0) return false;
+
+    for (uint64_t i = pos; i < offset; ++i) {
+        if (fputc(0, f) == EOF) return false;
+    }
+
+    return true;
+}
+
+//sines and cosines of the centre of each quantised direction angle, theta
+//covers [0, pi] and phi covers [-pi, pi)
+struct DirectionTable {
+    float cos_theta[256], sin_theta[256];
+    float cos_phi[256], sin_phi[256];
+
+    DirectionTable()
+    {
+        for (int i = 0; i < 256; ++i) {
+            double theta = (i + 0.5)*pi/256.0;
+            double phi = (i + 0.5)*2.0*pi/256.0 - pi;
+            cos_theta[i] = cos(theta);
+            sin_theta[i] = sin(theta);
+            cos_phi[i] = cos(phi);
+            sin_phi[i] = sin(phi);
+        }
+    }
+};
+
+const DirectionTable directions;
+
+uint8_t quantise(double value, double scale)
+{
+    int i = (int)(value*scale);
+    return (uint8_t)std::max(0, std::min(i, 255));
+}
+
+}
+
+void PhotonMap::Photon::set_power(float r, float g, float b)
+{
+    //Ward's rgbe, the mantissas share the exponent of the largest component
+    //and are rounded so that decoding needs no offset
+    float v = std::max(r, std::max(g, b));
+    if (!(v > 1e-32f)) {
+        power[0] = power[1] = power[2] = power[3] = 0;
+        return;
+    }
+
+    int e;
+    frexpf(v, &e);
+    float scale = ldexpf(1.0f, 8 - e);
+    power[0] = (uint8_t)std::min(255.0f, r*scale + 0.5f);
+    power[1] = (uint8_t)std::min(255.0f, g*scale + 0.5f);
+    power[2] = (uint8_t)std::min(255.0f, b*scale + 0.5f);
+    power[3] = (uint8_t)(e + 128);
+}
+
+void PhotonMap::Photon::get_power(float &r, float &g, float &b) const
+{
+    if (!power[3]) {
+        r = g = b = 0.0f;
+        return;
+    }
+
+    float scale = ldexpf(1.0f, power[3] - (128 + 8));
+    r = power[0]*scale;
+    g = power[1]*scale;
+    b = power[2]*scale;
+}
+
+void PhotonMap::Photon::set_direction(const Vec &direction)
+{
+    double z = std::max(-1.0, std::min(direction.z, 1.0));
+    theta = quantise(acos(z), 256.0/pi);
+    phi = quantise(atan2(direction.y, direction.x) + pi, 256.0/(2.0*pi));
+}
+
+Vec PhotonMap::Photon::get_direction() const
+{
+    return Vec(directions.sin_theta[theta]*directions.cos_phi[phi],
+        directions.sin_theta[theta]*directions.sin_phi[phi],
+        directions.cos_theta[theta]);
+}
 
 PhotonMap::PhotonMap()
-    : photons(nullptr), map(nullptr), number_emitted(0)
+    : photons(nullptr), mapping(nullptr), mapping_size(0), nphotons(0),
+      map(nullptr), number_emitted(0), direct_lighting(false)
+{
+}
+
+PhotonMap::~PhotonMap()
 {
+    clear();
 }
 
-void PhotonMap::build(const Scene &scene, int nphotons,
-    bool include_direct_lighting, int max_depth)
+void PhotonMap::clear()
 {
-    photons.reset(new Photon[nphotons]);
-    this->nphotons = nphotons;
+    //the tree may point into the mapping so goes first
+    map.reset();
+    storage.reset();
+    photons = nullptr;
+    nphotons = 0;
+    number_emitted = 0;
+    direct_lighting = false;
+
+    if (mapping) {
+        munmap(mapping, mapping_size);
+        mapping = nullptr;
+        mapping_size = 0;
+    }
+}
 
+bool PhotonMap::build(const Scene &scene, int nphotons,
+    bool include_direct_lighting, int max_depth, int nthreads)
+{
     //assume one light per scene for now
     Intersectable *light = nullptr;
     float light_r = 0.0, light_g = 0.0, light_b = 0.0;
@@ -54,107 +199,259 @@ void PhotonMap::build(const Scene &scene, int nphotons,
         }
     }
 
-    int i = 0;
-    while (i < nphotons) {
-
-        //initialize ray from light source
-        Ray ray = light->emit();
-        bool in_scene = true;
-        float R, G, B;
-        R = light_r;
-        G = light_g;
-        B = light_b;
-
-        while (in_scene && ray.depth < max_depth) {
-            Vec pt, n;
-            Material *material;
-
-            ++number_emitted;
-
-            if (scene.intersect(ray, 0.1, std::numeric_limits<double>::max(),
-                pt, n, material)) {
-
-                //if lambertian material, store in photon map
-                if (material->isLambertian()) {
+    Ray ray;
+    RandomSampler sampler(1);
+    if (!light || !light->emit(sampler, ray)) {
+        fprintf(stderr, "error: no light which can emit photons\n");
+        return false;
+    }
 
-                    LambertianMaterial *lm;
-                    lm = static_cast<LambertianMaterial *>(material);
+    //each path starts with the power of the whole light, the radiance of a
+    //diffuse emitter times pi times its area, queries divide by the number
+    //of paths
+    double power = pi*light->emitting_area();
+    light_r *= power;
+    light_g *= power;
+    light_b *= power;
+    float cutoff = 0.001f*std::max(light_r, std::max(light_g, light_b));
+
+    //traces paths [first, first + CHUNK_PATHS), each photon path is a
+    //separate sample so that the map does not depend on the thread count
+    auto trace_chunk = [&](uint64_t first, Sampler &sampler, Chunk &chunk) {
+        for (uint64_t path = first; path < first + CHUNK_PATHS; ++path) {
+            sampler.start(path, 0);
+
+            //initialize ray from light source
+            Ray ray;
+            light->emit(sampler, ray);
+            bool in_scene = true;
+            float R, G, B;
+            R = light_r;
+            G = light_g;
+            B = light_b;
+
+            while (in_scene && ray.depth < max_depth) {
+                Vec pt, n;
+                Material *material;
+
+                if (scene.intersect(ray, 0.001, std::numeric_limits<double>::max(),
+                    pt, n, material)) {
+
+                    //if lambertian material, store the arriving power in
+                    //the photon map
+                    if (material->isLambertian()) {
+
+                        LambertianMaterial *lm;
+                        lm = static_cast<LambertianMaterial *>(material);
+
+                        Vec direction = ray.origin - pt;
+                        direction.normalize();
+
+                        if (include_direct_lighting || ray.depth > 0) {
+                            Photon photon(pt);
+                            photon.set_power(R, G, B);
+                            photon.set_direction(direction);
+                            photon.flags = 0;
+                            chunk.photons.push_back(photon);
+                            chunk.paths.push_back(path);
+                        }
+
+                        //the bounce is cosine weighted like the brdf, so
+                        //only the albedo attenuates the power
+                        R *= lm->r*lm->reflectivity;
+                        G *= lm->g*lm->reflectivity;
+                        B *= lm->b*lm->reflectivity;
 
-                    Vec direction = ray.origin - pt;
-                    direction.normalize();
-                    float c = n.dot(direction);
-                    if (c > 0.0f) {
-                        R *= lm->r*c;
-                        G *= lm->g*c;
-                        B *= lm->b*c;
                     }
 
-                    /*
-                    printf("%d %f %f %f -> ", ray.depth, lm->r, lm->g, lm->b);
-                    printf("%f %f %f\n", R, G, B);
-                    */
-
-                    if (include_direct_lighting || ray.depth > 0) {
-                        photons[i].direction = direction;
-                        photons[i].location = pt;
-                        photons[i].r = R;
-                        photons[i].g = G;
-                        photons[i].b = B;
-
-                        ++i;
+                    if (R < cutoff && G < cutoff && B < cutoff) {
+                        in_scene = false;
+                    } else {
+                        //update ray
+                        ++ray.depth;
+                        ray.origin = pt;
+
+                        Vec u, v;
+                        n.construct_basis(u, v);
+                        double u1, u2;
+                        sampler.get_2d(Sampler::bounce_dimension(ray.depth,
+                            Sampler::DIRECTION_U), u1, u2);
+                        Vec w = Vec::sample_hemisphere_cosine_weighted(u1, u2);
+                        ray.direction = u*w.x + v*w.y + n*w.z;
+                        ray.direction.normalize();
                     }
+                } else {
+                    in_scene = false;
+                }
+            }
+        }
+    };
+
+    //chunks are traced in rounds on all threads and merged in order, the
+    //map is the first nphotons photons stored and number_emitted counts the
+    //paths up to the one which stored the last of them
+    std::vector<Photon> stored;
+    stored.reserve(nphotons);
+    number_emitted = 0;
+    uint64_t next_path = 0;
+    size_t nchunks = nthreads;
+    while ((int)stored.size() < nphotons) {
+        std::vector<Chunk> chunks(nchunks);
+        std::atomic<size_t> next(0);
+        auto worker = [&]() {
+            RandomSampler sampler(1);
+            for (size_t i = next++; i < nchunks; i = next++) {
+                trace_chunk(next_path + i*CHUNK_PATHS, sampler, chunks[i]);
+            }
+        };
 
-                    //Attenuation due to surface absorption
-                    R *= lm->reflectivity;
-                    G *= lm->reflectivity;
-                    B *= lm->reflectivity;
+        std::vector<std::thread> threads;
+        for (int i = 1; i < nthreads; ++i) {
+            threads.push_back(std::thread(worker));
+        }
+        worker();
 
-                }  else {
-                }
+        for (auto& thread : threads) {
+            thread.join();
+        }
 
-                if (R < 0.001 && G < 0.001 && B < 0.001) {
-                    in_scene = false;
-                } else {
-                    //update ray
-                    ++ray.depth;
-                    ray.origin = pt;
-
-                    Vec u, v;
-                    n.construct_basis(u, v);
-                    Vec w = Vec::sample_hemisphere_cosine_weighted();
-                    ray.direction = u*w.x + v*w.y + n*w.z;
-                    ray.direction.normalize();
-                }
+        for (size_t i = 0; i < nchunks && (int)stored.size() < nphotons; ++i) {
+            const Chunk &chunk = chunks[i];
+            size_t count = std::min(chunk.photons.size(),
+                nphotons - stored.size());
+            stored.insert(stored.end(), chunk.photons.begin(),
+                chunk.photons.begin() + count);
+
+            if ((int)stored.size() == nphotons) {
+                number_emitted = chunk.paths[count - 1] + 1;
             } else {
-                in_scene = false;
+                number_emitted = next_path + (i + 1)*CHUNK_PATHS;
             }
         }
+
+        next_path += nchunks*CHUNK_PATHS;
+
+        //give up on scenes where photons are rarely stored
+        if ((int)stored.size() < nphotons
+            && next_path >= (uint64_t)nphotons*MAX_PATHS_PER_PHOTON) {
+            fprintf(stderr, "warning: only %zu of %d photons were stored\n",
+                stored.size(), nphotons);
+            break;
+        }
+
+        //size the next round from the photons stored per path so far
+        size_t remaining = nphotons - stored.size();
+        double per_chunk = (double)stored.size()*CHUNK_PATHS/next_path;
+        nchunks = per_chunk > 0.0 ? (size_t)ceil(remaining/per_chunk) : nthreads;
+        nchunks = std::max(nthreads, (int)std::min<size_t>(nchunks, 64*nthreads));
+        nchunks = (nchunks + nthreads - 1)/nthreads*nthreads;
     }
 
-    map.reset(new KdTree<Photon, double>(3, photons.get(), nphotons));
+    int emitted = number_emitted;
+    clear();
+    number_emitted = emitted;
+    direct_lighting = include_direct_lighting;
+    this->nphotons = stored.size();
+    storage.reset(new Photon[this->nphotons]);
+    photons = storage.get();
+    std::copy(stored.begin(), stored.end(), photons);
+
+    map.reset(new Tree(3, photons, this->nphotons,
+        nthreads));
+
+    return true;
 }
 
 void PhotonMap::query(const Vec &pt, const Vec &norm, int nphotons, double eps,
     float &r, float &g, float &b) const
 {
-    r = g = b = 0.0f;
+    //each shading thread has its own search space and results, which only
+    //allocate when a query asks for more photons than any before it
+    thread_local Tree::Scratch scratch;
+    thread_local std::vector<Tree::Neighbour> neighbours;
+    if (neighbours.size() < (size_t)nphotons) neighbours.resize(nphotons);
+
+    size_t count = map->knn(Photon(pt), nphotons, eps, scratch, &neighbours[0]);
+    estimate(&neighbours[0], count, count ? neighbours[count - 1].distance : 0,
+        norm, r, g, b);
+}
 
-    std::list<std::pair<Photon *, double> > qr = map->knn(nphotons, pt, eps);
-    for (std::list<std::pair<Photon *, double> >::iterator itor = qr.begin();
-        itor != qr.end(); ++itor) {
-            if (itor->first->direction.dot(norm) > 0) {
-                r += itor->first->r;
-                g += itor->first->g;
-                b += itor->first->b;
-            }
+void PhotonMap::query_within(const Vec &pt, const Vec &norm, int nphotons,
+    double radius, double eps, float &r, float &g, float &b) const
+{
+    thread_local Tree::Scratch scratch;
+    thread_local std::vector<Tree::Neighbour> neighbours;
+    if (neighbours.size() < (size_t)nphotons) neighbours.resize(nphotons);
+
+    size_t count = map->knn(Photon(pt), nphotons, radius, eps, scratch,
+        &neighbours[0]);
+    estimate(&neighbours[0], count, count == (size_t)nphotons
+        ? neighbours[count - 1].distance : radius*radius, norm, r, g, b);
+}
+
+void PhotonMap::query_radius(const Vec &pt, const Vec &norm, double radius,
+    float &r, float &g, float &b) const
+{
+    thread_local Tree::Scratch scratch;
+    thread_local std::vector<Tree::Neighbour> neighbours;
+    neighbours.clear();
+    map->range(Photon(pt), radius, scratch, [&](Photon *photon, float distance) {
+        neighbours.push_back({photon, distance});
+    });
+
+    estimate(neighbours.data(), neighbours.size(), radius*radius, norm,
+        r, g, b);
+}
+
+void PhotonMap::query_packet(const Vec *pts, const Vec *norms, unsigned active,
+    int nphotons, double eps, float *r, float *g, float *b) const
+{
+    thread_local Tree::PacketScratch scratch;
+    thread_local std::vector<Tree::Neighbour> neighbours;
+    if (neighbours.size() < (size_t)nphotons*PACKET_SIZE) {
+        neighbours.resize(nphotons*PACKET_SIZE);
+    }
+
+    Photon points[PACKET_SIZE];
+    for (int i = 0; i < PACKET_SIZE; ++i) {
+        if (active & (1u << i)) points[i] = Photon(pts[i]);
     }
 
-    double scale = 1.0/(3.14159265358979323f*qr.back().second*number_emitted);
+    size_t counts[PACKET_SIZE];
+    map->knn_packet(points, active, nphotons, eps, scratch, &neighbours[0],
+        counts);
+
+    for (int i = 0; i < PACKET_SIZE; ++i) {
+        if (active & (1u << i)) {
+            const Tree::Neighbour *found = &neighbours[i*nphotons];
+            estimate(found, counts[i], counts[i] ? found[counts[i] - 1].distance : 0,
+                norms[i], r[i], g[i], b[i]);
+        }
+    }
+}
+
+void PhotonMap::estimate(const Tree::Neighbour *neighbours, size_t count,
+    float radius2, const Vec &norm, float &r, float &g, float &b) const
+{
+    r = g = b = 0.0f;
+    if (!count) return;
+
+    for (size_t i = 0; i < count; ++i) {
+        const Photon *photon = neighbours[i].pt;
+        if (photon->get_direction().dot(norm) > 0) {
+            float pr, pg, pb;
+            photon->get_power(pr, pg, pb);
+            r += pr;
+            g += pg;
+            b += pb;
+        }
+    }
+
+    double scale = 1.0/(3.14159265358979323f*radius2*number_emitted);
 
     r *= scale;
     g *= scale;
     b *= scale;
-
 }
 
 void PhotonMap::write(const char *filename) const
@@ -169,10 +466,139 @@ void PhotonMap::write(const char *filename) const
 
     for (int i = 0; i < nphotons; ++i) {
         const Photon &p = photons[i];
+        float r, g, b;
+        p.get_power(r, g, b);
 
         fprintf(f, "%f %f %f %f %f %f\n",
-            p.location.x, p.location.y, p.location.z, p.r, p.g, p.b);
+            p.location[0], p.location[1], p.location[2], r, g, b);
     }
 
     fclose(f);
 }
+
+bool PhotonMap::save(FILE *f) const
+{
+    int32_t header[3] = {nphotons, number_emitted, direct_lighting};
+    if (fwrite(header, sizeof(header), 1, f) != 1) return false;
+
+    return fwrite(photons, sizeof(Photon), nphotons, f) == (size_t)nphotons;
+}
+
+bool PhotonMap::load(FILE *f)
+{
+    int32_t header[3];
+    if (fread(header, sizeof(header), 1, f) != 1 || header[0] < 0) return false;
+
+    clear();
+    nphotons = header[0];
+    number_emitted = header[1];
+    direct_lighting = header[2];
+    storage.reset(new Photon[nphotons]);
+    photons = storage.get();
+    if (fread(photons, sizeof(Photon), nphotons, f) != (size_t)nphotons) {
+        return false;
+    }
+
+    //the photons were saved in heap order, so they are already the tree
+    map.reset(new Tree(3, photons, nphotons, Tree::Prebuilt()));
+
+    return true;
+}
+
+bool PhotonMap::save(const char *filename) const
+{
+    FILE *f = fopen(filename, "wb");
+    if (!f) {
+        fprintf(stderr, "error: could not write photon map to %s\n", filename);
+        return false;
+    }
+
+    FileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, FILE_MAGIC, sizeof(FILE_MAGIC));
+    header.version = FILE_VERSION;
+    header.byte_order = FILE_BYTE_ORDER;
+    header.photon_size = sizeof(Photon);
+    header.direct_lighting = direct_lighting;
+    header.nphotons = size();
+    header.number_emitted = number_emitted;
+    header.photon_offset = align(sizeof(header));
+
+    //an empty map is just the header
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+    if (ok && header.nphotons) {
+        ok = pad(f, header.photon_offset)
+            && fwrite(photons, sizeof(Photon), header.nphotons, f)
+                == header.nphotons;
+    }
+
+    if (fclose(f) != 0) ok = false;
+    if (!ok) {
+        fprintf(stderr, "error: could not write photon map to %s\n", filename);
+    }
+
+    return ok;
+}
+
+bool PhotonMap::open(const char *filename)
+{
+    int fd = ::open(filename, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "error: could not open photon map %s\n", filename);
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (uint64_t)st.st_size < sizeof(FileHeader)) {
+        fprintf(stderr, "error: %s is not a photon map\n", filename);
+        close(fd);
+        return false;
+    }
+
+    size_t length = st.st_size;
+    void *data = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "error: could not map photon map %s\n", filename);
+        return false;
+    }
+
+    //the contents are used as they are, so the header has to describe the
+    //same layout as this build and the arrays have to fit in the file
+    const FileHeader &header = *(const FileHeader *)data;
+    const char *error = nullptr;
+    if (memcmp(header.magic, FILE_MAGIC, sizeof(FILE_MAGIC)) != 0) {
+        error = "is not a photon map";
+    } else if (header.version != FILE_VERSION
+        || header.byte_order != FILE_BYTE_ORDER
+        || header.photon_size != sizeof(Photon)) {
+        error = "was written by an incompatible version";
+    } else if (header.direct_lighting > 1
+        || header.nphotons > (uint64_t)INT32_MAX
+        || header.number_emitted > (uint64_t)INT32_MAX
+        || header.photon_offset % FILE_ALIGNMENT
+        || (header.nphotons && (header.photon_offset > length
+            || (length - header.photon_offset)/sizeof(Photon) < header.nphotons))) {
+        error = "is truncated or corrupt";
+    }
+
+    if (error) {
+        fprintf(stderr, "error: %s %s\n", filename, error);
+        munmap(data, length);
+        return false;
+    }
+
+    clear();
+    mapping = data;
+    mapping_size = length;
+    nphotons = header.nphotons;
+    number_emitted = header.number_emitted;
+    direct_lighting = header.direct_lighting;
+
+    //the mapping is read only, the photons are already in heap order so
+    //the tree does not write to them
+    photons = (Photon *)((char *)data + header.photon_offset);
+    map.reset(new Tree(3, photons, nphotons, Tree::Prebuilt()));
+
+    return true;
+}
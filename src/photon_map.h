@@ -23,55 +23,195 @@ THE SOFTWARE.
 #ifndef PHOTON_MAP_H_
 #define PHOTON_MAP_H_
 
+#include <cstdint>
+#include <cstdio>
 #include <memory>
+#include <vector>
 
-#include "kdtree.h"
+#include "balanced_kdtree.h"
 #include "vec.h"
 
 struct Scene;
 
 class PhotonMap {
 
+    //packed 20 byte photon after Jensen, a float position, power as shared
+    //exponent rgbe and the incoming direction as quantised spherical angles.
+    //The low two bits of flags hold the kd-tree split axis. Plain data so
+    //that photons can be written to a file and used in place when it is
+    //mapped back in
     struct Photon {
-        Vec direction;
-        Vec location;
-        float r, g, b;
+        float location[3];
+        uint8_t power[4];
+        uint8_t theta, phi;
+        uint16_t flags;
 
         Photon()
         {
         }
 
-        Photon(const Vec &pt) : location(pt)
+        Photon(const Vec &pt) : location{(float)pt.x, (float)pt.y, (float)pt.z}
         {
         }
 
-        double &operator[](int index)
+        float &operator[](int index)
         {
-            return (&location.x)[index];
+            return location[index];
         }
 
-        double operator[](int index) const
+        float operator[](int index) const
         {
-            return (&location.x)[index];
+            return location[index];
         }
+
+        int get_axis() const
+        {
+            return flags & 3;
+        }
+
+        void set_axis(int axis)
+        {
+            flags = (flags & ~3) | axis;
+        }
+
+        void set_power(float r, float g, float b);
+        void get_power(float &r, float &g, float &b) const;
+
+        //direction is a unit vector
+        void set_direction(const Vec &direction);
+        Vec get_direction() const;
+    };
+
+    static_assert(sizeof(Photon) == 20, "photons should pack to 20 bytes");
+
+    typedef BalancedKdTree<Photon, float> Tree;
+
+    //photons stored by a run of paths, and the path each came from
+    struct Chunk {
+        std::vector<Photon> photons;
+        std::vector<uint64_t> paths;
     };
 
-    std::unique_ptr<Photon[]> photons;
+    //paths traced by a thread at a time while building
+    static const int CHUNK_PATHS = 1024;
+
+    //paths traced before giving up on storing the requested photons
+    static const int MAX_PATHS_PER_PHOTON = 100;
+
+    //photons are owned after building or loading a checkpoint, otherwise
+    //they point into a mapped photon map file. Either way they are in the
+    //kd-tree's heap order
+    std::unique_ptr<Photon[]> storage;
+    Photon *photons;
+    void *mapping;
+    size_t mapping_size;
     int nphotons;
-    std::unique_ptr<KdTree<Photon, double> > map;
+    std::unique_ptr<Tree> map;
     int number_emitted;
+    bool direct_lighting;
 
 public:
 
     PhotonMap();
+    ~PhotonMap();
+
+    PhotonMap(const PhotonMap &) = delete;
+    PhotonMap &operator=(const PhotonMap &) = delete;
+
+    /**
+        Traces photons from the first light in the scene, returns false if
+        there is no light which can emit them.
 
-    void build(const Scene &scene, int nphotons,
-        bool include_direct_lighting, int max_depth);
+        \param nphotons The number of photons to store.
+        \param max_depth The maximum number of bounces per path.
+        \param nthreads The number of threads tracing paths.
+    */
+    bool build(const Scene &scene, int nphotons,
+        bool include_direct_lighting, int max_depth, int nthreads = 1);
 
     void query(const Vec &pt, const Vec &norm, int nphotons, double eps,
         float &r, float &g, float &b) const;
 
+    /**
+        As query, but only photons within a radius of the point are used.
+        If fewer than nphotons are found the estimate is over the whole
+        disc rather than out to the farthest photon.
+
+        \param radius The largest distance a photon may be from pt.
+    */
+    void query_within(const Vec &pt, const Vec &norm, int nphotons,
+        double radius, double eps, float &r, float &g, float &b) const;
+
+    /**
+        Estimates irradiance from every photon within a fixed radius of the
+        point, as progressive photon mapping does.
+
+        \param radius The radius of the disc the photons are gathered from.
+    */
+    void query_radius(const Vec &pt, const Vec &norm, double radius,
+        float &r, float &g, float &b) const;
+
+    //the number of points query_packet takes
+    static const int PACKET_SIZE = Tree::PACKET_SIZE;
+
+    /**
+        Queries a packet of points together, finding their photons in one
+        traversal of the kd-tree. This is cheaper than separate queries when
+        the points are close together, such as the hits of a packet of
+        camera rays.
+
+        \param pts The points, PACKET_SIZE of them.
+        \param norms The surface normal at each point.
+        \param active Bit i is set if pts[i] is to be queried.
+        \param r, g, b Receive the irradiance at each active point.
+    */
+    void query_packet(const Vec *pts, const Vec *norms, unsigned active,
+        int nphotons, double eps, float *r, float *g, float *b) const;
+
     void write(const char *filename) const;
+
+    bool empty() const
+    {
+        return !map;
+    }
+
+    int size() const
+    {
+        return map ? nphotons : 0;
+    }
+
+    //number of light paths traced to store the photons
+    int emitted() const
+    {
+        return number_emitted;
+    }
+
+    //whether the photons include those arriving straight from the light,
+    //in which case shading must not add direct lighting as well
+    bool includes_direct_lighting() const
+    {
+        return direct_lighting;
+    }
+
+    //binary form of the photons, used to embed the map in checkpoints,
+    //load restores the kd-tree rather than tracing photons again
+    bool save(FILE *f) const;
+    bool load(FILE *f);
+
+    //versioned binary file holding the photons in the layout and order used
+    //in memory, open maps the file rather than parsing it so
+    //it is only portable between builds with the same Photon layout
+    bool save(const char *filename) const;
+    bool open(const char *filename);
+
+private:
+
+    void clear();
+
+    //irradiance from the photons found around a point, spread over a disc
+    //of squared radius radius2
+    void estimate(const Tree::Neighbour *neighbours, size_t count,
+        float radius2, const Vec &norm, float &r, float &g, float &b) const;
 };
 
 
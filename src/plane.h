@@ -33,8 +33,8 @@ struct Plane : public Intersectable {
     Vec p;
     Vec normal;
 
-    virtual bool intersect(const Ray &ray, double tmin, double tmax,
-        Vec &pt, Vec &norm, Material *&mat) const
+    //distance along the ray to the hit, if any
+    bool intersect(const Ray &ray, double tmin, double tmax, double &t) const
     {
         double n = (p - ray.origin).dot(normal);
         double d = ray.direction.dot(normal);
@@ -43,13 +43,50 @@ struct Plane : public Intersectable {
         if (fabs(d) < INTERSECTION_EPSILON) return false;
 
         //calculate hit
-        double t = n/d;
+        t = n/d;
         if (t < tmin || t > tmax) return false;
 
-        pt = ray.origin + ray.direction*t;
+        return true;
+    }
+
+    virtual bool intersect(const Ray &ray, double tmin, Hit &hit) const
+    {
+        double t;
+        if (!intersect(ray, tmin, hit.t, t)) return false;
+
+        hit.set(t, this);
+        return true;
+    }
+
+    virtual void surface(const Ray &ray, const Hit &hit, Vec &pt, Vec &norm,
+        Material *&mat) const
+    {
+        pt = ray.origin + ray.direction*hit.t;
         norm = normal;
         mat = material.get();
-        return true;
+    }
+
+    virtual bool occluded(const Ray &ray, double tmin, double tmax) const
+    {
+        double t;
+        return intersect(ray, tmin, tmax, t);
+    }
+
+    virtual unsigned intersect_packet(const RayPacket &packet, unsigned active,
+        double tmin, Hit *hits) const
+    {
+        unsigned result = 0;
+        for (int i = 0; i < RayPacket::SIZE; ++i) {
+            if (!(active & (1u << i))) continue;
+
+            double t;
+            if (intersect(packet.rays[i], tmin, hits[i].t, t)) {
+                hits[i].set(t, this);
+                result |= 1u << i;
+            }
+        }
+
+        return result;
     }
 
 };
@@ -0,0 +1,313 @@
+/*
+Copyright (c) 2018 Daniel Minor
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include "png_encoder.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <thread>
+
+namespace {
+
+const size_t BPP = 3;
+
+void put_u32(unsigned char *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+unsigned char paeth(int a, int b, int c)
+{
+    int p = a + b - c;
+    int pa = abs(p - a);
+    int pb = abs(p - b);
+    int pc = abs(p - c);
+    if (pa <= pb && pa <= pc) return a;
+    if (pb <= pc) return b;
+    return c;
+}
+
+}
+
+PngEncoder::PngEncoder(size_t width, size_t height, Filter filter, int level)
+    : width(width), height(height), filter(filter), level(level), f(nullptr),
+      rows_written(0), adler(adler32(0, Z_NULL, 0)), failed(false)
+{
+    if (this->level < 0) this->level = 0;
+    if (this->level > 9) this->level = 9;
+}
+
+PngEncoder::~PngEncoder()
+{
+    if (f) fclose(f);
+}
+
+bool PngEncoder::parse_filter(const char *name, Filter &filter)
+{
+    static const char *names[] = {"none", "sub", "up", "average", "paeth",
+        "adaptive"};
+    for (int i = 0; i <= FILTER_ADAPTIVE; ++i) {
+        if (!strcmp(name, names[i])) {
+            filter = (Filter)i;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool PngEncoder::open(const char *filename)
+{
+    f = fopen(filename, "wb");
+    if (!f) {
+        fprintf(stderr, "error: could not open: %s\n", filename);
+        return false;
+    }
+
+    static const unsigned char signature[] = {137, 'P', 'N', 'G', '\r', '\n',
+        26, '\n'};
+    if (fwrite(signature, sizeof(signature), 1, f) != 1) failed = true;
+
+    //8 bit rgb, deflate, adaptive filtering, no interlacing
+    unsigned char header[13];
+    put_u32(header, width);
+    put_u32(header + 4, height);
+    header[8] = 8;
+    header[9] = 2;
+    header[10] = 0;
+    header[11] = 0;
+    header[12] = 0;
+    write_chunk("IHDR", header, sizeof(header));
+
+    return !failed;
+}
+
+void PngEncoder::filter_row(int type, const unsigned char *row,
+    const unsigned char *above, unsigned char *out) const
+{
+    size_t n = width*BPP;
+    out[0] = type;
+    ++out;
+
+    switch (type) {
+    case FILTER_NONE:
+        memcpy(out, row, n);
+        break;
+    case FILTER_SUB:
+        for (size_t i = 0; i < n; ++i) {
+            out[i] = row[i] - (i >= BPP ? row[i - BPP] : 0);
+        }
+        break;
+    case FILTER_UP:
+        for (size_t i = 0; i < n; ++i) {
+            out[i] = row[i] - (above ? above[i] : 0);
+        }
+        break;
+    case FILTER_AVERAGE:
+        for (size_t i = 0; i < n; ++i) {
+            int a = i >= BPP ? row[i - BPP] : 0;
+            int b = above ? above[i] : 0;
+            out[i] = row[i] - ((a + b) >> 1);
+        }
+        break;
+    case FILTER_PAETH:
+        for (size_t i = 0; i < n; ++i) {
+            int a = i >= BPP ? row[i - BPP] : 0;
+            int b = above ? above[i] : 0;
+            int c = i >= BPP && above ? above[i - BPP] : 0;
+            out[i] = row[i] - paeth(a, b, c);
+        }
+        break;
+    }
+}
+
+bool PngEncoder::compress(const unsigned char *const *rows, size_t count,
+    const unsigned char *above, bool last, Segment &segment) const
+{
+    size_t stride = width*BPP + 1;
+    std::vector<unsigned char> filtered(count*stride);
+    std::vector<unsigned char> candidate(filter == FILTER_ADAPTIVE ? stride : 0);
+
+    for (size_t y = 0; y < count; ++y) {
+        unsigned char *out = &filtered[y*stride];
+        const unsigned char *prev = y ? rows[y - 1] : above;
+        if (filter != FILTER_ADAPTIVE) {
+            filter_row(filter, rows[y], prev, out);
+            continue;
+        }
+
+        //the usual heuristic, filtered bytes are treated as signed and the
+        //filter with the smallest sum of absolute values is chosen
+        unsigned long best = ~0ul;
+        for (int type = FILTER_NONE; type <= FILTER_PAETH; ++type) {
+            filter_row(type, rows[y], prev, &candidate[0]);
+            unsigned long sum = 0;
+            for (size_t i = 1; i < stride; ++i) {
+                sum += abs((signed char)candidate[i]);
+            }
+
+            if (sum < best) {
+                best = sum;
+                memcpy(out, &candidate[0], stride);
+            }
+        }
+    }
+
+    segment.rows = count;
+    segment.length = filtered.size();
+    segment.adler = adler32(adler32(0, Z_NULL, 0), &filtered[0], filtered.size());
+
+    //the first segment starts the zlib stream, the rest are raw deflate
+    //data which continues it
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+    if (deflateInit2(&z, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return false;
+    }
+
+    size_t offset = 0;
+    segment.data.resize(2 + deflateBound(&z, filtered.size()) + 16);
+    if (!above) {
+        //window size 32k, compression level hint, header checksum
+        unsigned header = 0x7800 | ((level < 2 ? 0 : level < 6 ? 1 : level == 6 ? 2 : 3) << 6);
+        header += 31 - header%31;
+        segment.data[0] = header >> 8;
+        segment.data[1] = header;
+        offset = 2;
+    }
+
+    //a full flush ends the segment on a byte boundary without marking the
+    //final block, so the next segment can follow it directly
+    z.next_in = &filtered[0];
+    z.avail_in = filtered.size();
+    z.next_out = &segment.data[offset];
+    z.avail_out = segment.data.size() - offset;
+    //the output is sized by deflateBound, so everything must fit in one
+    //call, Z_BUF_ERROR or unconsumed input means it did not
+    int status = deflate(&z, last ? Z_FINISH : Z_FULL_FLUSH);
+    bool ok = (last ? status == Z_STREAM_END : status == Z_OK) && !z.avail_in;
+    segment.data.resize(segment.data.size() - z.avail_out);
+    deflateEnd(&z);
+
+    return ok;
+}
+
+bool PngEncoder::write(Segment &segment)
+{
+    if (!f || rows_written + segment.rows > height) {
+        failed = true;
+        return false;
+    }
+
+    rows_written += segment.rows;
+    adler = adler32_combine(adler, segment.adler, segment.length);
+    if (rows_written == height) {
+        unsigned char checksum[4];
+        put_u32(checksum, adler);
+        segment.data.insert(segment.data.end(), checksum, checksum + 4);
+    }
+
+    write_chunk("IDAT", &segment.data[0], segment.data.size());
+
+    return !failed;
+}
+
+bool PngEncoder::write_image(const unsigned char *const *rows,
+    size_t nthreads)
+{
+    size_t segment_rows = std::max<size_t>(1, SEGMENT_BYTES/(width*BPP + 1));
+    size_t nsegments = (height + segment_rows - 1)/segment_rows;
+    std::vector<Segment> segments(nsegments);
+
+    //segments do not depend on the thread count, so neither does the file
+    std::atomic<size_t> next(0);
+    std::atomic<bool> compressed(true);
+    auto worker = [&]() {
+        for (size_t i = next++; i < nsegments; i = next++) {
+            size_t y = i*segment_rows;
+            if (!compress(rows + y, std::min(segment_rows, height - y),
+                y ? rows[y - 1] : nullptr, i + 1 == nsegments, segments[i])) {
+                compressed = false;
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < std::min(nthreads, nsegments); ++i) {
+        threads.push_back(std::thread(worker));
+    }
+    worker();
+
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    if (!compressed) {
+        failed = true;
+        return false;
+    }
+
+    for (auto& segment : segments) {
+        if (!write(segment)) return false;
+    }
+
+    return true;
+}
+
+bool PngEncoder::close()
+{
+    if (!f) return false;
+
+    write_chunk("IEND", nullptr, 0);
+    bool ok = !failed && rows_written == height;
+    if (fclose(f)) ok = false;
+    f = nullptr;
+
+    if (!ok) fprintf(stderr, "error: could not write png.\n");
+
+    return ok;
+}
+
+void PngEncoder::write_chunk(const char *type, const unsigned char *data,
+    size_t length)
+{
+    unsigned char header[8];
+    put_u32(header, length);
+    memcpy(header + 4, type, 4);
+
+    uLong crc = crc32(0, Z_NULL, 0);
+    crc = crc32(crc, header + 4, 4);
+    if (length) crc = crc32(crc, data, length);
+    unsigned char trailer[4];
+    put_u32(trailer, crc);
+
+    if (fwrite(header, sizeof(header), 1, f) != 1
+        || (length && fwrite(data, length, 1, f) != 1)
+        || fwrite(trailer, sizeof(trailer), 1, f) != 1) {
+        failed = true;
+    }
+}
@@ -0,0 +1,120 @@
+/*
+Copyright (c) 2018 Daniel Minor
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#ifndef PNG_ENCODER_H_
+#define PNG_ENCODER_H_
+
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include <zlib.h>
+
+/*
+Writes 8 bit RGB PNGs. Rows are filtered and deflated in segments, each
+segment is a separate raw deflate stream ending on a full flush so that
+segments can be compressed on different threads and concatenated into a
+single zlib stream. The adler32 checksums of the segments are combined
+as they are written.
+*/
+class PngEncoder {
+
+public:
+
+    enum Filter {
+        FILTER_NONE = 0,
+        FILTER_SUB = 1,
+        FILTER_UP = 2,
+        FILTER_AVERAGE = 3,
+        FILTER_PAETH = 4,
+        FILTER_ADAPTIVE         //per row, the filter with the smallest sum
+    };
+
+    //compressed rows, in the order they are written
+    struct Segment {
+        std::vector<unsigned char> data;
+        size_t rows;
+        uLong adler;            //of the filtered rows
+        size_t length;          //of the filtered rows
+    };
+
+    //filtered bytes per segment when compressing a whole image, large
+    //enough that restarting the compressor costs little
+    static const size_t SEGMENT_BYTES = 256*1024;
+
+    /**
+        \param filter The filter applied to every row.
+        \param level The zlib compression level, 0 to 9.
+    */
+    PngEncoder(size_t width, size_t height, Filter filter, int level);
+
+    //abandons the file if it was not closed
+    virtual ~PngEncoder();
+
+    //parses none, sub, up, average, paeth or adaptive
+    static bool parse_filter(const char *name, Filter &filter);
+
+    //writes the signature and header
+    bool open(const char *filename);
+
+    /**
+        Filters and compresses rows, may be called from several threads at
+        once.
+
+        \param rows The rows to compress, three bytes per pixel.
+        \param count The number of rows.
+        \param above The row before the first, null for the first row of the
+                     image.
+        \param last Whether these are the last rows of the image.
+        \param segment Receives the compressed rows.
+        \return false if zlib failed, segment must not be written.
+    */
+    bool compress(const unsigned char *const *rows, size_t count,
+        const unsigned char *above, bool last, Segment &segment) const;
+
+    //writes segments in order, the last one is followed by the checksum
+    bool write(Segment &segment);
+
+    //compresses and writes every row of the image using nthreads threads
+    bool write_image(const unsigned char *const *rows, size_t nthreads);
+
+    //returns false if rows are missing or any write failed
+    bool close();
+
+private:
+
+    size_t width, height;
+    Filter filter;
+    int level;
+
+    FILE *f;
+    size_t rows_written;
+    uLong adler;
+    bool failed;
+
+    void filter_row(int type, const unsigned char *row,
+        const unsigned char *above, unsigned char *out) const;
+    void write_chunk(const char *type, const unsigned char *data,
+        size_t length);
+};
+
+#endif
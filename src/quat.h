@@ -82,7 +82,7 @@ struct Quat {
     Quat operator*(Vec other) const
     {
         Quat result;
-        result.s = 0.0;
+        result.s = -v.dot(other);
         result.v = other*s + v.cross(other);
         return result;
     }
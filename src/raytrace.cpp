@@ -20,25 +20,52 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
 THE SOFTWARE.
 */
 
+#include <algorithm>
+#include <chrono>
 #include <cmath>
+#include <condition_variable>
 #include <cstdio>
 #include <cstring>
 #include <limits>
+#include <memory>
+#include <mutex>
+#include <string>
 #include <thread>
+#include <vector>
 
+#include "checkpoint.h"
+#include "framebuffer.h"
 #include "image.h"
+#include "image_stream.h"
+#include "lambertian_material.h"
 #include "photon_map.h"
+#include "png_encoder.h"
+#include "ray_packet.h"
+#include "sampler.h"
 #include "scene.h"
+#include "tile_scheduler.h"
 #include "vec.h"
 #include "view.h"
 
 int main(int argc, char **argv)
 {
+    auto program_start = std::chrono::steady_clock::now();
 
     if (argc < 3) {
         fprintf(stderr, "usage: raytrace <view> <scene> [--samples]");
-        fprintf(stderr, " [--use-photon-map]");
+        fprintf(stderr, " [--use-photon-map] [--final-gather]");
         fprintf(stderr, " [--build-photons] [--query-photons]");
+        fprintf(stderr, " [--save-photon-map=<file>] [--load-photon-map=<file>]");
+        fprintf(stderr, " [--bvh-width]");
+        fprintf(stderr, " [--tile-size] [--stats]");
+        fprintf(stderr, " [--sampler=random|sobol|cmj]");
+        fprintf(stderr, " [--adaptive=<error>] [--max-samples]");
+        fprintf(stderr, " [--time-budget=<seconds>] [--write-pfm]");
+        fprintf(stderr, " [--checkpoint=<file>] [--checkpoint-interval]");
+        fprintf(stderr, " [--checkpoint-photon-map] [--resume=<file>]");
+        fprintf(stderr, " [--stream]");
+        fprintf(stderr, " [--png-filter=none|sub|up|average|paeth|adaptive]");
+        fprintf(stderr, " [--png-level]");
         return 1;
     }
 
@@ -49,21 +76,33 @@ int main(int argc, char **argv)
         return 1;
     }
 
-    //scene
-    Scene scene;
-    if (!scene.open(argv[2])) {
-        fprintf(stderr, "error: could not open scene: %s\n",argv[2]);
-        return 1;
-    }
-
     //look at other arguments
+    Scene scene;
     scene.use_photon_map = false;
+    scene.final_gather = false;
+    scene.bvh_width = 2;
     bool write_photon_map = false;
+    bool write_pfm = false;
     bool include_direct_lighting = false;
     int samples = 10;
     int bphotons = 10000;
     int qphotons = 50;
     int nthreads = std::thread::hardware_concurrency();
+    int tile_size = 16;
+    bool stats = false;
+    const char *sampler_name = "sobol";
+    double adaptive = 0.0;
+    int max_samples = 0;
+    double time_budget = 0.0;
+    std::string checkpoint_file;
+    double checkpoint_interval = 60.0;
+    bool checkpoint_photon_map = false;
+    std::string resume_file;
+    std::string save_photon_map_file;
+    std::string load_photon_map_file;
+    bool stream = false;
+    PngEncoder::Filter png_filter = PngEncoder::FILTER_UP;
+    int png_level = 6;
 
     for (int i = 3; i < argc; ++i) {
         if (sscanf(argv[i], "--samples=%d", &samples) == 1) {
@@ -74,10 +113,18 @@ int main(int argc, char **argv)
             scene.use_photon_map = true;
         }
 
+        if (!strcmp(argv[i], "--final-gather")) {
+            scene.final_gather = true;
+        }
+
         if (!strcmp(argv[i], "--write-photon-map")) {
             write_photon_map = true;
         }
 
+        if (!strcmp(argv[i], "--write-pfm")) {
+            write_pfm = true;
+        }
+
         if (!strcmp(argv[i], "--include-direct-lighting")) {
             include_direct_lighting = true;
         }
@@ -93,91 +140,490 @@ int main(int argc, char **argv)
         if (sscanf(argv[i], "--nthreads=%d", &nthreads) == 1) {
             if (nthreads < 1) nthreads = 1;
         }
+
+        if (sscanf(argv[i], "--bvh-width=%d", &scene.bvh_width) == 1) {
+            if (scene.bvh_width != 4 && scene.bvh_width != 8) {
+                scene.bvh_width = 2;
+            }
+        }
+
+        if (sscanf(argv[i], "--tile-size=%d", &tile_size) == 1) {
+            if (tile_size < 1) tile_size = 1;
+        }
+
+        if (!strcmp(argv[i], "--stats")) {
+            stats = true;
+        }
+
+        if (!strncmp(argv[i], "--sampler=", 10)) {
+            sampler_name = argv[i] + 10;
+        }
+
+        if (sscanf(argv[i], "--adaptive=%lf", &adaptive) == 1) {
+            if (adaptive < 0.0) adaptive = 0.0;
+        }
+
+        sscanf(argv[i], "--max-samples=%d", &max_samples);
+
+        sscanf(argv[i], "--time-budget=%lf", &time_budget);
+
+        if (!strncmp(argv[i], "--checkpoint=", 13)) {
+            checkpoint_file = argv[i] + 13;
+        }
+
+        sscanf(argv[i], "--checkpoint-interval=%lf", &checkpoint_interval);
+
+        if (!strcmp(argv[i], "--checkpoint-photon-map")) {
+            checkpoint_photon_map = true;
+        }
+
+        if (!strncmp(argv[i], "--resume=", 9)) {
+            resume_file = argv[i] + 9;
+        }
+
+        if (!strncmp(argv[i], "--save-photon-map=", 18)) {
+            save_photon_map_file = argv[i] + 18;
+        }
+
+        //a loaded photon map is only useful when rendering with it
+        if (!strncmp(argv[i], "--load-photon-map=", 18)) {
+            load_photon_map_file = argv[i] + 18;
+            scene.use_photon_map = true;
+        }
+
+        if (!strcmp(argv[i], "--stream")) {
+            stream = true;
+        }
+
+        if (!strncmp(argv[i], "--png-filter=", 13)) {
+            if (!PngEncoder::parse_filter(argv[i] + 13, png_filter)) {
+                fprintf(stderr, "error: unknown png filter: %s\n", argv[i] + 13);
+                return 1;
+            }
+        }
+
+        if (sscanf(argv[i], "--png-level=%d", &png_level) == 1) {
+            if (png_level < 0) png_level = 0;
+            if (png_level > 9) png_level = 9;
+        }
+    }
+
+    //hardware_concurrency may not know, in which case it returns 0
+    if (nthreads < 1) nthreads = 1;
+
+    //a streamed image is written as tiles complete, so there is no image
+    //wide state to refine or save
+    if (stream && (adaptive > 0.0 || time_budget > 0.0 || write_pfm
+        || !checkpoint_file.empty() || !resume_file.empty())) {
+        fprintf(stderr, "error: --stream cannot be used with --adaptive,"
+            " --time-budget, --write-pfm, --checkpoint or --resume\n");
+        return 1;
+    }
+
+    //samples are traced in rounds of samples*samples, in adaptive mode
+    //pixels get further rounds until their error is below the threshold or
+    //they reach max_samples
+    int round = samples*samples;
+    if (time_budget > 0.0) {
+        //progressive passes until the budget runs out, or there are
+        //max_samples if it is given
+        if (max_samples < 0) max_samples = 0;
+    } else if (adaptive == 0.0) {
+        max_samples = round;
+    } else if (max_samples <= 0) {
+        //adaptive sampling without a cap stops at 16 rounds
+        max_samples = 16*round;
+    } else if (max_samples < round) {
+        //the first pass is always a full round
+        fprintf(stderr, "warning: --max-samples raised to %d, one round of --samples\n",
+            round);
+        max_samples = round;
+    }
+
+    //the budget includes loading the scene and building the photon map
+    auto deadline = program_start
+        + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            std::chrono::duration<double>(time_budget));
+
+    //samples per pixel
+    std::unique_ptr<Sampler> sampler(Sampler::create(sampler_name,
+        samples*samples));
+    if (!sampler) {
+        fprintf(stderr, "error: unknown sampler: %s\n", sampler_name);
+        return 1;
+    }
+
+    //scene
+    if (!scene.open(argv[2])) {
+        fprintf(stderr, "error: could not open scene: %s\n",argv[2]);
+        return 1;
+    }
+
+    //continue from a checkpoint, which may include the photon map
+    Framebuffer framebuffer(stream ? 0 : view.width, stream ? 0 : view.height);
+    Checkpoint checkpoint;
+    bool has_photon_map = false;
+    if (!resume_file.empty()) {
+        if (!checkpoint.load(resume_file.c_str(), framebuffer,
+                scene.use_photon_map ? &scene.photon_map : nullptr,
+                has_photon_map)) {
+            return 1;
+        }
+
+        if (strcmp(checkpoint.sampler, sampler_name)
+            || checkpoint.samples != (uint32_t)(samples*samples)) {
+            fprintf(stderr, "error: checkpoint used --sampler=%s with %u samples per round\n",
+                checkpoint.sampler, checkpoint.samples);
+            return 1;
+        }
+    } else {
+        strncpy(checkpoint.sampler, sampler_name, sizeof(checkpoint.sampler) - 1);
+        checkpoint.samples = samples*samples;
     }
 
     //build photon map
-    if (scene.use_photon_map) {
-        scene.photon_map.build(scene, bphotons, include_direct_lighting, 10);
+    scene.photon_map_direct = include_direct_lighting;
+    if (scene.use_photon_map && has_photon_map) {
+        scene.query_photons = qphotons;
+    } else if (scene.use_photon_map && !load_photon_map_file.empty()) {
+        auto load_start = std::chrono::steady_clock::now();
+        if (!scene.photon_map.open(load_photon_map_file.c_str())) {
+            return 1;
+        }
         scene.query_photons = qphotons;
 
+        if (stats) {
+            fprintf(stderr, "photon map: %.3fs, %d photons from %d paths loaded\n",
+                std::chrono::duration<double>(
+                    std::chrono::steady_clock::now() - load_start).count(),
+                scene.photon_map.size(), scene.photon_map.emitted());
+        }
+    } else if (scene.use_photon_map) {
+        auto build_start = std::chrono::steady_clock::now();
+        if (!scene.photon_map.build(scene, bphotons, include_direct_lighting,
+                10, nthreads)) {
+            return 1;
+        }
+        scene.query_photons = qphotons;
+
+        if (stats) {
+            fprintf(stderr, "photon map: %.3fs, %d photons from %d paths\n",
+                std::chrono::duration<double>(
+                    std::chrono::steady_clock::now() - build_start).count(),
+                scene.photon_map.size(), scene.photon_map.emitted());
+        }
+
         if (write_photon_map) {
             scene.photon_map.write("photon-map.txt");
         }
+
+        if (!save_photon_map_file.empty()
+            && !scene.photon_map.save(save_photon_map_file.c_str())) {
+            return 1;
+        }
     }
 
-    //create image and trace a ray for each pixel
-    Image image(view.width, view.height);
-    std::vector<std::thread> threads;
-    for (int thread = 0; thread < nthreads; ++thread) {
-        threads.push_back(std::thread([view, &scene, &image, thread, samples, nthreads] {
+    //a loaded or resumed photon map keeps the setting it was built with,
+    //otherwise direct lighting would be counted twice or not at all
+    if (scene.use_photon_map
+        && scene.photon_map.includes_direct_lighting() != include_direct_lighting) {
+        fprintf(stderr, "warning: photon map was built %s --include-direct-lighting, using that\n",
+            scene.photon_map.includes_direct_lighting() ? "with" : "without");
+        scene.photon_map_direct = scene.photon_map.includes_direct_lighting();
+    }
 
-            //eyepoint
-            Ray ray;
-            ray.origin = view.pos;
+    //trace a pass of samples [first, first + count) for every pixel, each
+    //thread takes tiles from the scheduler. Passes after the first sample
+    //are only traced for pixels which have not converged. Once past the
+    //deadline, threads stop taking tiles. thread_active records whether
+    //each thread traced any pixel.
+    std::vector<long> thread_samples(nthreads);
+    std::vector<char> thread_active(nthreads);
+    ImageStream image_stream(view.width, view.height, tile_size, png_filter,
+        png_level);
+    if (stream && !image_stream.open("image.png")) return 1;
+
+    //the threads and the scheduler last for the whole render, the main
+    //thread hands out one pass at a time and waits for it to complete before
+    //checkpointing or checking the deadline
+    TileScheduler scheduler(view.width, view.height, tile_size, nthreads,
+        stream);
+    std::mutex pass_mutex;
+    std::condition_variable pass_cv;
+    int pass_first = 0, pass_count = 0;
+    bool pass_deadline = false;
+    int passes_started = 0;
+    int threads_running = 0;
+    bool quit = false;
+
+    auto worker = [&](int thread) {
+
+        //camera rays are traced in packets, each ray records the pixel
+        //it belongs to so that its result can be accumulated
+        RayPacket packet;
+        int packet_pixel[RayPacket::SIZE];
+        std::unique_ptr<Sampler> packet_sampler[RayPacket::SIZE];
+        int packet_count = 0;
+        for (int i = 0; i < RayPacket::SIZE; ++i) {
+            packet.rays[i].origin = view.pos;
+            packet_sampler[i].reset(sampler->clone());
+        }
 
-            //intersection material, point and normal
-            Material *material = nullptr;
-            Vec pt;
-            Vec n;
+        Hit hits[RayPacket::SIZE];
 
-            Vec view_right = view.dir.cross(view.up);
+        //when streaming, samples are accumulated per tile and each
+        //tile is passed on to the stream as soon as it is complete
+        Framebuffer tile_buffer(stream ? tile_size : 0, stream ? tile_size : 0);
+        Framebuffer &target = stream ? tile_buffer : framebuffer;
+        std::vector<unsigned char> tile_row(stream ? tile_size*3 : 0);
+        Framebuffer::TonemapScratch tonemap_scratch;
 
-            double px_width = (view.u1 - view.u0)/view.width;
-            double px_height = (view.v1 - view.v0)/view.height;
+        auto trace_packet = [&]() {
+            for (int i = 0; i < RayPacket::SIZE; ++i) {
+                hits[i] = Hit();
+            }
 
-            int block = view.height / nthreads;
+            unsigned active = (1u << packet_count) - 1;
+            unsigned hit = scene.intersect_packet(packet, active, 0.0, hits);
 
-            for (int y = block*thread; y < block*(thread + 1); ++y) {
-                for (int x = 0; x < view.width; ++x) {
-                    float R = 0.0, G = 0.0, B = 0.0;
+            //shading data is only computed for the closest hit
+            Vec pt[RayPacket::SIZE], n[RayPacket::SIZE];
+            Material *mat[RayPacket::SIZE];
+            for (int i = 0; i < packet_count; ++i) {
+                if (hit & (1u << i)) {
+                    hits[i].surface(packet.rays[i], pt[i], n[i], mat[i]);
+                }
+            }
+
+            //photon map queries for lambertian hits are made
+            //together, PACKET_SIZE rays at a time
+            float er[RayPacket::SIZE], eg[RayPacket::SIZE], eb[RayPacket::SIZE];
+            unsigned lambertian = 0;
+            for (int i = 0; i < packet_count; ++i) {
+                if ((hit & (1u << i)) && mat[i] && mat[i]->isLambertian()
+                    && LambertianMaterial::uses_photon_map(scene, packet.rays[i])) {
+                    lambertian |= 1u << i;
+                }
+            }
+            for (int i = 0; i < packet_count; i += PhotonMap::PACKET_SIZE) {
+                unsigned mask = (lambertian >> i)
+                    & ((1u << PhotonMap::PACKET_SIZE) - 1);
+                if (mask) {
+                    scene.photon_map.query_packet(pt + i, n + i, mask,
+                        scene.query_photons, 0.0, er + i, eg + i, eb + i);
+                }
+            }
 
-                    for (int s = 0; s < samples; ++s) {
-                        for (int t = 0; t < samples; ++t) {
+            for (int i = 0; i < packet_count; ++i) {
+                float r, g, b;
+                if (!(hit & (1u << i))) {
+                    target.add(packet_pixel[i], 0.0f, 0.0f, 0.0f);
+                    continue;
+                }
 
-                            //calculate ray direction vector
-                            double us = view.u0 + px_width*(x + 0.5);
-                            us += (double)s*px_width/(double)samples + (-0.5 + ((double)rand()/(double)RAND_MAX))
-                                /(double)view.width/(double)samples;
+                if (lambertian & (1u << i)) {
+                    static_cast<LambertianMaterial *>(mat[i])->shade(scene,
+                        packet.rays[i], pt[i], n[i], *packet_sampler[i],
+                        er[i], eg[i], eb[i], r, g, b);
+                } else if (mat[i]) {
+                    mat[i]->shade(scene, packet.rays[i], pt[i], n[i], *packet_sampler[i], r, g, b);
+                } else {
+                    r = g = b = 0.0f;
+                }
+
+                target.add(packet_pixel[i], r, g, b);
+            }
+
+            packet_count = 0;
+        };
+
+        Vec view_right = view.dir.cross(view.up);
+
+        double px_width = (view.u1 - view.u0)/view.width;
+        double px_height = (view.v1 - view.v0)/view.height;
+
+        int seen = 0;
+        while (true) {
+            int first, count;
+            bool use_deadline;
+            {
+                std::unique_lock<std::mutex> lock(pass_mutex);
+                pass_cv.wait(lock, [&] { return quit || passes_started != seen; });
+                if (quit) break;
+                seen = passes_started;
+                first = pass_first;
+                count = pass_count;
+                use_deadline = pass_deadline;
+            }
+
+            Tile tile;
+            while (scheduler.next(thread, tile)) {
+                if (use_deadline && std::chrono::steady_clock::now() >= deadline) {
+                    break;
+                }
 
-                            double vs = view.v0 + px_height*(y + 0.5);
-                            vs += (double)t*px_height/(double)samples + (-0.5 + ((double)rand()/(double)RAND_MAX))
-                                /(double)view.height/(double)samples;
+                for (int y = tile.y0; y < tile.y1; ++y) {
+                    for (int x = tile.x0; x < tile.x1; ++x) {
+                        int pixel = y*view.width + x;
+                        if (first > 0 && framebuffer.pixel_stats(pixel).error() < adaptive) {
+                            continue;
+                        }
+
+                        thread_active[thread] = true;
+                        thread_samples[thread] += count;
+                        for (int index = first; index < first + count; ++index) {
+
+                            //samples are identified by pixel and index so
+                            //that the result does not depend on the thread
+                            //count
+                            Sampler &s = *packet_sampler[packet_count];
+                            s.start(pixel, index);
+
+                            //calculate ray direction vector
+                            double us = view.u0 + px_width*(x + s.get(Sampler::PIXEL_X));
+                            double vs = view.v0 + px_height*(y + s.get(Sampler::PIXEL_Y));
 
                             //negate y to correct for (0, 0) being top left rather than
                             //bottom left
+                            Ray &ray = packet.rays[packet_count];
                             ray.direction = view_right*us - view.up*vs + view.dir;
                             ray.direction.normalize();
+                            packet_pixel[packet_count] = stream
+                                ? (y - tile.y0)*tile_size + x - tile.x0 : pixel;
 
-                            if (scene.intersect(ray, 0.0,
-                                std::numeric_limits<double>::max(), pt, n, material)) {
-
-                                float r, g, b;
-                                if (material) {
-                                    material->shade(scene, ray, pt, n, r, g, b);
-                                } else {
-                                    r = g = b = 0.0f;
-                                }
-
-                                float scale = 1.0f/(float)(samples*samples);
-
-                                R += r*scale;
-                                G += g*scale;
-                                B += b*scale;
-                            }
+                            if (++packet_count == RayPacket::SIZE) trace_packet();
                         }
                     }
+                }
 
-                    image.set(x, y, R, G, B);
+                if (packet_count) trace_packet();
+
+                if (stream) {
+                    for (int y = tile.y0; y < tile.y1; ++y) {
+                        tile_buffer.tonemap_row(y - tile.y0, &tile_row[0],
+                            tonemap_scratch);
+                        image_stream.set_span(tile.x0, y, tile.x1 - tile.x0,
+                            &tile_row[0]);
+                    }
+                    tile_buffer.clear();
                 }
             }
-        }));
+
+            std::lock_guard<std::mutex> lock(pass_mutex);
+            if (--threads_running == 0) pass_cv.notify_all();
+        }
+    };
+
+    auto render = [&](int first, int count, bool use_deadline) {
+        std::unique_lock<std::mutex> lock(pass_mutex);
+        scheduler.reset();
+        pass_first = first;
+        pass_count = count;
+        pass_deadline = use_deadline;
+        threads_running = nthreads;
+        ++passes_started;
+        pass_cv.notify_all();
+        pass_cv.wait(lock, [&] { return threads_running == 0; });
+    };
+
+    //passes are one sample per pixel when progressive or checkpointing so
+    //that the state can be saved often, otherwise a round of samples
+    int pass_size = round;
+    if (time_budget > 0.0 || !checkpoint_file.empty()) pass_size = 1;
+
+    std::unique_ptr<CheckpointWriter> writer;
+    if (!checkpoint_file.empty()) {
+        writer.reset(new CheckpointWriter(checkpoint_file,
+            checkpoint_photon_map ? &scene.photon_map : nullptr));
+    }
+
+    std::vector<std::thread> threads;
+    for (int thread = 0; thread < nthreads; ++thread) {
+        threads.push_back(std::thread(worker, thread));
     }
 
+    auto render_start = std::chrono::steady_clock::now();
+    auto last_checkpoint = render_start;
+    int passes = 0;
+    while (max_samples == 0 || (int)checkpoint.next < max_samples) {
+        //the first pass is always completed so that every pixel has a value
+        bool use_deadline = time_budget > 0.0 && checkpoint.next > 0;
+
+        //a checkpoint may have been written with a different pass size, so
+        //the first pass after resuming only runs up to the next multiple of
+        //pass_size. The last pass stops at max_samples, which need not be a
+        //whole number of passes
+        int count = pass_size - checkpoint.next % pass_size;
+        if (max_samples) count = std::min(count, max_samples - (int)checkpoint.next);
+
+        std::fill(thread_active.begin(), thread_active.end(), false);
+        render(checkpoint.next, count, use_deadline);
+        checkpoint.next += count;
+        ++passes;
+
+        bool active = false;
+        for (char a : thread_active) active = active || a;
+
+        auto now = std::chrono::steady_clock::now();
+        bool finished = !active
+            || (time_budget > 0.0 && now >= deadline)
+            || (max_samples && (int)checkpoint.next >= max_samples);
+        if (writer && (finished
+            || std::chrono::duration<double>(now - last_checkpoint).count()
+                >= checkpoint_interval)) {
+            writer->write(checkpoint, framebuffer);
+            last_checkpoint = now;
+        }
+
+        if (finished) break;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(pass_mutex);
+        quit = true;
+    }
+    pass_cv.notify_all();
+
     for (auto& thread : threads) {
         thread.join();
     }
 
-    image.save("image.png");
+    //time not spent rendering was spent waiting for work or for the other
+    //threads to finish
+    if (stats) {
+        double elapsed = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - render_start).count();
+        long total = 0;
+        for (long n : thread_samples) total += n;
+        fprintf(stderr, "render: %.3fs, %.2f samples per pixel", elapsed,
+            (double)total/(view.width*view.height));
+        fprintf(stderr, ", %d passes", passes);
+        if (stream) fprintf(stderr, ", %zu bands buffered", image_stream.peak_bands());
+        fprintf(stderr, "\n");
+        for (int thread = 0; thread < nthreads; ++thread) {
+            const TileScheduler::Stats &s = scheduler.stats(thread);
+            fprintf(stderr, "thread %d: busy %.3fs idle %.3fs tiles %d stolen %d\n",
+                thread, s.busy, elapsed - s.busy, s.tiles, s.stolen);
+        }
+    }
+
+    if (stream) {
+        return image_stream.close() ? 0 : 1;
+    }
+
+    if (write_pfm) {
+        framebuffer.save_pfm("image.pfm");
+    }
+
+    auto save_start = std::chrono::steady_clock::now();
+    Image image(view.width, view.height);
+    framebuffer.tonemap(image);
+
+    bool saved = image.save("image.png", png_filter, png_level, nthreads);
+    if (stats) {
+        fprintf(stderr, "save: %.3fs\n", std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - save_start).count());
+    }
 
-    return 0;
+    return saved ? 0 : 1;
 }
@@ -0,0 +1,81 @@
+/*
+Copyright (c) 2018 Daniel Minor
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#ifndef RNG_H_
+#define RNG_H_
+
+#include <cstdint>
+
+/*
+PCG32 random number generator (O'Neill, 2014). It is cheap enough to create
+one per sample, so each camera sample or photon path is seeded from its
+index rather than sharing global state between threads. The sequence for a
+given seed does not depend on the number of threads rendering.
+*/
+class Rng {
+
+public:
+
+    /**
+        \param seed Selects the starting point, e.g. the pixel index.
+        \param stream Selects one of 2^63 independent sequences, e.g. the
+                      sample index within the pixel.
+    */
+    Rng(uint64_t seed = 0, uint64_t stream = 0)
+    {
+        state = 0;
+        inc = (stream << 1) | 1;
+        next();
+        state += mix(seed);
+        next();
+    }
+
+    uint32_t next()
+    {
+        uint64_t old = state;
+        state = old*6364136223846793005ULL + inc;
+        uint32_t xorshifted = (uint32_t)(((old >> 18) ^ old) >> 27);
+        uint32_t rot = (uint32_t)(old >> 59);
+        return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
+    }
+
+    //uniform in [0, 1)
+    double uniform()
+    {
+        return next()*(1.0/4294967296.0);
+    }
+
+private:
+
+    uint64_t state;
+    uint64_t inc;
+
+    //splitmix64 finalizer so that consecutive seeds give unrelated states
+    static uint64_t mix(uint64_t x)
+    {
+        x = (x ^ (x >> 30))*0xbf58476d1ce4e5b9ULL;
+        x = (x ^ (x >> 27))*0x94d049bb133111ebULL;
+        return x ^ (x >> 31);
+    }
+};
+
+#endif
@@ -0,0 +1,77 @@
+/*
+Copyright (c) 2018 Daniel Minor
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#ifndef SAMPLE_STATS_H_
+#define SAMPLE_STATS_H_
+
+#include <algorithm>
+#include <cmath>
+
+/*
+Running mean and variance of the luminance of the samples of a pixel,
+using Welford's method, so that the error estimate can drive adaptive
+sampling. Colour is accumulated separately by the Framebuffer.
+*/
+struct SampleStats {
+
+    static const int MIN_SAMPLES = 8;
+
+    int n;
+    double mean;        //mean luminance
+    double m2;          //sum of squared differences from the mean
+
+    SampleStats() : n(0), mean(0.0), m2(0.0) {};
+
+    void add(double y)
+    {
+        ++n;
+        double delta = y - mean;
+        mean += delta/n;
+        m2 += delta*(y - mean);
+    }
+
+    //combines the statistics of two disjoint sets of samples (Chan et al.)
+    void merge(const SampleStats &other)
+    {
+        if (!other.n) return;
+
+        int total = n + other.n;
+        double delta = other.mean - mean;
+        mean += delta*other.n/total;
+        m2 += other.m2 + delta*delta*((double)n*other.n/total);
+        n = total;
+    }
+
+    //standard error of the mean luminance after the square root applied
+    //when the image is written, so that the threshold is roughly uniform
+    //in output brightness. Dark pixels use a floor rather than their mean
+    //so that they are not sampled forever. Too few samples gives an
+    //unreliable estimate, so at least MIN_SAMPLES are required.
+    double error() const
+    {
+        if (n < MIN_SAMPLES) return HUGE_VAL;
+        double variance = m2/(n - 1);
+        return sqrt(variance/n)/(2.0*sqrt(std::max(mean, 0.01)));
+    }
+};
+
+#endif
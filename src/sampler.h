@@ -0,0 +1,365 @@
+/*
+Copyright (c) 2018 Daniel Minor
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#ifndef SAMPLER_H_
+#define SAMPLER_H_
+
+#include <cstdint>
+#include <cstring>
+
+#include "rng.h"
+
+/*
+Source of sample values in [0, 1). A sample is identified by its pixel and
+its index within the pixel, and each use of a random number along its path
+is given a fixed dimension so that low discrepancy samplers stratify the
+pixel, lens and every bounce independently of what happened earlier on the
+path. Dimensions are used in pairs, the even dimension of a pair being the
+first coordinate of a 2D pattern.
+*/
+class Sampler {
+
+public:
+
+    enum Dimension {
+        PIXEL_X,
+        PIXEL_Y,
+        LENS_U,
+        LENS_V,
+        BOUNCE_START
+    };
+
+    //offsets from bounce_dimension() for each bounce along a path
+    enum BounceDimension {
+        DIRECTION_U,
+        DIRECTION_V,
+        LIGHT_CHOICE,
+        COMPONENT_CHOICE,
+        DIMENSIONS_PER_BOUNCE
+    };
+
+    static unsigned bounce_dimension(int depth, unsigned offset)
+    {
+        return BOUNCE_START + depth*DIMENSIONS_PER_BOUNCE + offset;
+    }
+
+    virtual ~Sampler() {};
+
+    //selects the sample which subsequent calls to get() refer to
+    void start(uint32_t pixel, uint32_t index)
+    {
+        this->pixel = pixel;
+        this->index = index;
+    }
+
+    virtual double get(unsigned dimension) const = 0;
+
+    //dimension should be even, patterns are 2D over a pair of dimensions
+    virtual void get_2d(unsigned dimension, double &u, double &v) const
+    {
+        u = get(dimension);
+        v = get(dimension + 1);
+    }
+
+    virtual Sampler *clone() const = 0;
+
+    /**
+        Creates a sampler by name, returns nullptr if the name is unknown.
+
+        \param name One of random, sobol or cmj.
+        \param samples The number of samples per pixel, patterns are
+                       stratified over this many samples.
+    */
+    static Sampler *create(const char *name, uint32_t samples);
+
+protected:
+
+    uint32_t pixel;
+    uint32_t index;
+    uint32_t samples;
+
+    Sampler(uint32_t samples) : pixel(0), index(0), samples(samples) {};
+
+    //lowbias32 integer hash by Chris Wellons
+    static uint32_t hash(uint32_t x)
+    {
+        x ^= x >> 16;
+        x *= 0x7feb352dU;
+        x ^= x >> 15;
+        x *= 0x846ca68bU;
+        x ^= x >> 16;
+        return x;
+    }
+
+    static uint32_t hash(uint32_t a, uint32_t b)
+    {
+        return hash(a ^ (hash(b) + 0x9e3779b9U + (a << 6) + (a >> 2)));
+    }
+};
+
+//independent uniform random values, each dimension of each sample has its
+//own stream so results do not depend on the order values are requested
+class RandomSampler : public Sampler {
+
+public:
+
+    RandomSampler(uint32_t samples) : Sampler(samples) {};
+
+    virtual double get(unsigned dimension) const
+    {
+        Rng rng(((uint64_t)pixel << 32) | index, dimension);
+        return rng.uniform();
+    }
+
+    virtual Sampler *clone() const
+    {
+        return new RandomSampler(*this);
+    }
+};
+
+/*
+Owen scrambled Sobol sequence following Burley (2020), Practical Hash-based
+Owen Scrambling. Each pair of dimensions uses the first two Sobol dimensions
+with the index shuffled and the values scrambled by a hash of the pixel and
+the pair, which gives well stratified 2D projections without needing
+direction numbers for high dimensions.
+*/
+class SobolSampler : public Sampler {
+
+public:
+
+    SobolSampler(uint32_t samples) : Sampler(samples) {};
+
+    virtual double get(unsigned dimension) const
+    {
+        uint32_t seed = hash(pixel, dimension/2);
+        uint32_t i = nested_uniform_scramble(index, seed);
+        if (dimension & 1) return to_double(second(i, seed));
+        return to_double(first(i, seed));
+    }
+
+    virtual void get_2d(unsigned dimension, double &u, double &v) const
+    {
+        uint32_t seed = hash(pixel, dimension/2);
+        uint32_t i = nested_uniform_scramble(index, seed);
+        u = to_double(first(i, seed));
+        v = to_double(second(i, seed));
+    }
+
+    virtual Sampler *clone() const
+    {
+        return new SobolSampler(*this);
+    }
+
+private:
+
+    //use the top 24 bits so the result is strictly less than one
+    static double to_double(uint32_t x)
+    {
+        return (x >> 8)*(1.0/16777216.0);
+    }
+
+    //the first Sobol dimension is the bit reversed index, so scrambling it
+    //reduces to permuting the index directly
+    static uint32_t first(uint32_t i, uint32_t seed)
+    {
+        return reverse_bits(laine_karras(i, hash(seed, 0)));
+    }
+
+    static uint32_t second(uint32_t i, uint32_t seed)
+    {
+        return nested_uniform_scramble(sobol_second(i), hash(seed, 1));
+    }
+
+    //second Sobol dimension, generated a byte of the index at a time
+    static uint32_t sobol_second(uint32_t index)
+    {
+        struct Table {
+            uint32_t x[4][256];
+
+            Table()
+            {
+                //direction numbers for the polynomial x + 1
+                uint32_t v[32];
+                v[0] = 1U << 31;
+                for (int bit = 1; bit < 32; ++bit) v[bit] = v[bit - 1] ^ (v[bit - 1] >> 1);
+
+                for (int byte = 0; byte < 4; ++byte) {
+                    for (uint32_t i = 0; i < 256; ++i) {
+                        x[byte][i] = 0;
+                        for (int bit = 0; bit < 8; ++bit) {
+                            if (i & (1U << bit)) x[byte][i] ^= v[byte*8 + bit];
+                        }
+                    }
+                }
+            }
+        };
+        static const Table table;
+
+        return table.x[0][index & 0xff] ^ table.x[1][(index >> 8) & 0xff]
+            ^ table.x[2][(index >> 16) & 0xff] ^ table.x[3][index >> 24];
+    }
+
+    static uint32_t reverse_bits(uint32_t x)
+    {
+        x = ((x >> 1) & 0x55555555U) | ((x & 0x55555555U) << 1);
+        x = ((x >> 2) & 0x33333333U) | ((x & 0x33333333U) << 2);
+        x = ((x >> 4) & 0x0f0f0f0fU) | ((x & 0x0f0f0f0fU) << 4);
+        x = ((x >> 8) & 0x00ff00ffU) | ((x & 0x00ff00ffU) << 8);
+        return (x >> 16) | (x << 16);
+    }
+
+    //Laine-Karras style permutation, each bit depends only on lower bits
+    static uint32_t laine_karras(uint32_t x, uint32_t seed)
+    {
+        x += seed;
+        x ^= x*0x6c50b47cU;
+        x ^= x*0xb82f1e52U;
+        x ^= x*0xc7afe638U;
+        x ^= x*0x8d22f6e6U;
+        return x;
+    }
+
+    static uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed)
+    {
+        return reverse_bits(laine_karras(reverse_bits(x), seed));
+    }
+};
+
+/*
+Correlated multi-jittered sampling, Kensler (2013). Each pair of dimensions
+is an m x n multi-jittered pattern over the samples of a pixel, where
+m*n = samples, permuted by a hash of the pixel and the pair. Sample indices
+beyond the pattern size start a new pattern.
+*/
+class CmjSampler : public Sampler {
+
+public:
+
+    CmjSampler(uint32_t samples) : Sampler(samples ? samples : 1)
+    {
+        //choose the most square factorisation of samples
+        m = 1;
+        for (uint32_t i = 1; i*i <= this->samples; ++i) {
+            if (this->samples % i == 0) m = i;
+        }
+        n = this->samples/m;
+    }
+
+    virtual double get(unsigned dimension) const
+    {
+        uint32_t p = hash(hash(pixel, dimension/2), index/samples);
+        uint32_t s = permute(index % samples, samples, p*0x51633e2dU);
+        if (dimension & 1) return second(s, p);
+        return first(s, p);
+    }
+
+    virtual void get_2d(unsigned dimension, double &u, double &v) const
+    {
+        uint32_t p = hash(hash(pixel, dimension/2), index/samples);
+        uint32_t s = permute(index % samples, samples, p*0x51633e2dU);
+        u = first(s, p);
+        v = second(s, p);
+    }
+
+    virtual Sampler *clone() const
+    {
+        return new CmjSampler(*this);
+    }
+
+private:
+
+    uint32_t m, n;
+
+    double first(uint32_t s, uint32_t p) const
+    {
+        uint32_t sy = permute(s/m, n, p*0x63d83595U);
+        double jx = randfloat(s, p*0xa399d265U);
+        return (s % m + (sy + jx)/n)/m;
+    }
+
+    double second(uint32_t s, uint32_t p) const
+    {
+        uint32_t sx = permute(s % m, m, p*0xa511e9b3U);
+        double jy = randfloat(s, p*0x711ad6a5U);
+        return (s/m + (sx + jy)/m)/n;
+    }
+
+    //random permutation of i within [0, l)
+    static uint32_t permute(uint32_t i, uint32_t l, uint32_t p)
+    {
+        uint32_t w = l - 1;
+        w |= w >> 1;
+        w |= w >> 2;
+        w |= w >> 4;
+        w |= w >> 8;
+        w |= w >> 16;
+        do {
+            i ^= p;
+            i *= 0xe170893dU;
+            i ^= p >> 16;
+            i ^= (i & w) >> 4;
+            i ^= p >> 8;
+            i *= 0x0929eb3fU;
+            i ^= p >> 23;
+            i ^= (i & w) >> 1;
+            i *= 1 | p >> 27;
+            i *= 0x6935fa69U;
+            i ^= (i & w) >> 11;
+            i *= 0x74dcb303U;
+            i ^= (i & w) >> 2;
+            i *= 0x9e501cc3U;
+            i ^= (i & w) >> 2;
+            i *= 0xc860a3dfU;
+            i &= w;
+            i ^= i >> 5;
+        } while (i >= l);
+
+        return (i + p) % l;
+    }
+
+    //random value in [0, 1) for i
+    static double randfloat(uint32_t i, uint32_t p)
+    {
+        i ^= p;
+        i ^= i >> 17;
+        i ^= i >> 10;
+        i *= 0xb36534e5U;
+        i ^= i >> 12;
+        i ^= i >> 21;
+        i *= 0x93fc4795U;
+        i ^= 0xdf6e307fU;
+        i ^= i >> 17;
+        i *= 1 | p >> 18;
+        return i*(1.0/4294967296.0);
+    }
+};
+
+inline Sampler *Sampler::create(const char *name, uint32_t samples)
+{
+    if (!strcmp(name, "random")) return new RandomSampler(samples);
+    if (!strcmp(name, "sobol")) return new SobolSampler(samples);
+    if (!strcmp(name, "cmj")) return new CmjSampler(samples);
+    return nullptr;
+}
+
+#endif
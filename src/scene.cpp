@@ -27,6 +27,7 @@ extern "C" {
     #include <lualib.h>
 }
 
+#include <algorithm>
 #include <cstdio>
 
 #include "dielectric_material.h"
@@ -94,6 +95,11 @@ static int group(lua_State *ls)
         luaL_error(ls, "group: expected table");
     }
 
+    //get reference to the scene we are building
+    lua_getglobal(ls, "SCENE");
+    Scene *scene = reinterpret_cast<Scene *>(lua_touserdata(ls, -1));
+    lua_pop(ls, 1);
+
     Group *group = new Group;
 
     lua_getfield(ls, -1, "children");
@@ -101,10 +107,25 @@ static int group(lua_State *ls)
     while (lua_next(ls, -2)) {
         Intersectable *i = reinterpret_cast<Intersectable *>(lua_touserdata(ls, -1));
         lua_pop(ls, 1);
+        if (scene->instances.count(i)) {
+            luaL_error(ls, "group: child is already used by a transform");
+        }
+        if (!scene->adopted.insert(i).second) {
+            luaL_error(ls, "group: child is already in a group");
+        }
         group->children.push_back(std::unique_ptr<Intersectable>(i));
     }
     lua_pop(ls, 1);
 
+    int depth = 0;
+    for (auto& child : group->children) {
+        auto itor = scene->transform_depth.find(child.get());
+        if (itor != scene->transform_depth.end()) depth = std::max(depth, itor->second);
+    }
+    if (depth) scene->transform_depth[group] = depth;
+
+    group->build_bvh(scene->bvh_width);
+
     lua_pushlightuserdata(ls, group);
     return 1;
 }
@@ -218,6 +239,12 @@ static int scene(lua_State *ls)
     while (lua_next(ls, -2)) {
         Intersectable *i = reinterpret_cast<Intersectable *>(lua_touserdata(ls, -1));
         lua_pop(ls, 1);
+        if (scene->instances.count(i)) {
+            luaL_error(ls, "scene: child is already used by a transform");
+        }
+        if (!scene->adopted.insert(i).second) {
+            luaL_error(ls, "scene: child is already in a group");
+        }
         scene->children.push_back(std::unique_ptr<Intersectable>(i));
     }
     lua_pop(ls, 1);
@@ -291,11 +318,38 @@ static int transform(lua_State *ls)
     lua_getfield(ls, -1, "child");
     Intersectable *child = reinterpret_cast<Intersectable *>(lua_touserdata(ls, -1));
     lua_pop(ls, 1);
+    if (!child) {
+        luaL_error(ls, "transform: expected child");
+    }
+
+    //get reference to the scene we are building
+    lua_getglobal(ls, "SCENE");
+    Scene *scene = reinterpret_cast<Scene *>(lua_touserdata(ls, -1));
+    lua_pop(ls, 1);
+
+    if (scene->adopted.count(child)) {
+        luaL_error(ls, "transform: child is already in a group");
+    }
+
+    //hits only record so many transforms, deeper nesting would be shaded
+    //in the wrong space
+    auto itor = scene->transform_depth.find(child);
+    int depth = (itor != scene->transform_depth.end() ? itor->second : 0) + 1;
+    if (depth > Hit::MAX_INSTANCES) {
+        luaL_error(ls, "transform: nested more than %d deep", Hit::MAX_INSTANCES);
+    }
+
+    //optional, overrides the material of the child
+    lua_getfield(ls, -1, "material");
+    Material *mat = reinterpret_cast<Material *>(lua_touserdata(ls, -1));
+    lua_pop(ls, 1);
 
     Transform *transform = new Transform;
     transform->translation.x = x; transform->translation.y = y; transform->translation.z = z;
     transform->rotation = rotation;
-    transform->child = child;
+    transform->child = scene->instance(child);
+    transform->material.reset(mat);
+    scene->transform_depth[transform] = depth;
 
     lua_pushlightuserdata(ls, transform);
 
@@ -351,10 +405,16 @@ static int trimesh(lua_State *ls)
     Material *mat = reinterpret_cast<Material *>(lua_touserdata(ls, -1));
     lua_pop(ls, 1);
 
+    //get reference to the scene we are building
+    lua_getglobal(ls, "SCENE");
+    Scene *scene = reinterpret_cast<Scene *>(lua_touserdata(ls, -1));
+    lua_pop(ls, 1);
+
     TriangleMesh *tm = new TriangleMesh;
     tm->faces = std::move(faces);
     tm->vertices = std::move(vertices);
     tm->material.reset(mat);
+    tm->build_bvh(scene->bvh_width);
 
     lua_pushlightuserdata(ls, tm);
 
@@ -376,6 +436,13 @@ static luaL_Reg fns[] = {
     {0, 0}
 };
 
+std::shared_ptr<Intersectable> Scene::instance(Intersectable *object)
+{
+    std::shared_ptr<Intersectable> &result = instances[object];
+    if (!result) result.reset(object);
+    return result;
+}
+
 bool Scene::open(const char *filename)
 {
     bool result = true;
@@ -402,5 +469,13 @@ bool Scene::open(const char *filename)
     }
 
     lua_close(ls);
+
+    //transforms now hold the only references to shared objects
+    instances.clear();
+    adopted.clear();
+    transform_depth.clear();
+
+    if (result) build_bvh(bvh_width);
+
     return result;
 }
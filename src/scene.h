@@ -23,7 +23,9 @@ THE SOFTWARE.
 #ifndef SCENE_H_
 #define SCENE_H_
 
+#include <map>
 #include <memory>
+#include <set>
 
 #include "group.h"
 #include "photon_map.h"
@@ -36,8 +38,30 @@ struct Scene : public Group {
     bool use_photon_map;
     int query_photons;
 
+    //whether lambertian surfaces trace a bounce before using the photon
+    //map, and whether the map holds direct as well as indirect light
+    bool final_gather;
+    bool photon_map_direct;
+
+    //children per bvh node, must be set before the scene is opened
+    int bvh_width;
+
+    //objects referenced by transforms while loading, each is shared by all
+    //of the transforms referring to it
+    std::map<Intersectable *, std::shared_ptr<Intersectable> > instances;
+
+    //objects owned by a group or the scene while loading, which cannot also
+    //be owned by a transform or another group
+    std::set<Intersectable *> adopted;
+
+    //transforms nested inside each group or transform made while loading,
+    //a hit records at most Hit::MAX_INSTANCES of them
+    std::map<Intersectable *, int> transform_depth;
+
     bool open(const char *filename);
 
+    std::shared_ptr<Intersectable> instance(Intersectable *object);
+
 };
 
 #endif
@@ -35,7 +35,7 @@ struct SpecularMaterial : public Material {
     virtual ~SpecularMaterial() {};
 
     void shade(const Scene &scene, const Ray &incident, const Vec &pt,
-        const Vec &norm, float &r, float &g, float &b) const override
+        const Vec &norm, Sampler &sampler, float &r, float &g, float &b) const override
     {
         //reflection
         Ray ray;
@@ -55,7 +55,7 @@ struct SpecularMaterial : public Material {
 
         //emit ray
         if (scene.intersect(ray, 0.1, tmax, pt2, norm2, material)) {
-            material->shade(scene, ray, pt2, norm2, r, g, b);
+            material->shade(scene, ray, pt2, norm2, sampler, r, g, b);
         } else {
             r = g = b = 0.0;
         }
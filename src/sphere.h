@@ -32,8 +32,8 @@ struct Sphere : public Intersectable {
     Vec centre;
     double radius;
 
-    bool intersect(const Ray &ray, double tmin, double tmax,
-        Vec &pt, Vec &norm) const
+    //distance along the ray to the hit, if any
+    bool intersect(const Ray &ray, double tmin, double tmax, double &t) const
     {
         Vec e_minus_c = ray.origin - centre;
         double d_dot_d = ray.direction.dot(ray.direction);
@@ -42,22 +42,75 @@ struct Sphere : public Intersectable {
             - d_dot_d*(e_minus_c.dot(e_minus_c) - radius*radius);
 
         if (disc > 0.0) {
-            double t = -(ray.direction.dot(e_minus_c) + sqrt(disc))/d_dot_d;
+            t = -(ray.direction.dot(e_minus_c) + sqrt(disc))/d_dot_d;
 
             if (t < tmin || t > tmax) return false;
-
-            pt = ray.origin + (ray.direction*t);
-            norm = (pt - centre) * (1.0/radius);
             return true;
         } else {
             return false;
         }
     }
 
-    virtual bool intersect(const Ray &ray, double tmin, double tmax, Vec &pt, Vec &norm, Material *&mat) const
+    virtual bool bounds(BoundingBox &box) const
+    {
+        Vec r(radius, radius, radius);
+        box = BoundingBox(centre - r, centre + r);
+        return true;
+    }
+
+    virtual bool emit(Sampler &sampler, Ray &ray) const
+    {
+        double u1, u2;
+        sampler.get_2d(Sampler::PIXEL_X, u1, u2);
+        Vec n = Vec::sample_sphere(u1, u2);
+
+        ray = Ray(0, centre + n*radius, emit_direction(sampler, n));
+        return true;
+    }
+
+    virtual double emitting_area() const
+    {
+        return 4.0*pi*radius*radius;
+    }
+
+    virtual bool intersect(const Ray &ray, double tmin, Hit &hit) const
+    {
+        double t;
+        if (!intersect(ray, tmin, hit.t, t)) return false;
+
+        hit.set(t, this);
+        return true;
+    }
+
+    virtual void surface(const Ray &ray, const Hit &hit, Vec &pt, Vec &norm,
+        Material *&mat) const
     {
+        pt = ray.origin + (ray.direction*hit.t);
+        norm = (pt - centre) * (1.0/radius);
         mat = material.get();
-        return intersect(ray, tmin, tmax, pt, norm);
+    }
+
+    virtual bool occluded(const Ray &ray, double tmin, double tmax) const
+    {
+        double t;
+        return intersect(ray, tmin, tmax, t);
+    }
+
+    virtual unsigned intersect_packet(const RayPacket &packet, unsigned active,
+        double tmin, Hit *hits) const
+    {
+        unsigned result = 0;
+        for (int i = 0; i < RayPacket::SIZE; ++i) {
+            if (!(active & (1u << i))) continue;
+
+            double t;
+            if (intersect(packet.rays[i], tmin, hits[i].t, t)) {
+                hits[i].set(t, this);
+                result |= 1u << i;
+            }
+        }
+
+        return result;
     }
 };
 
@@ -0,0 +1,192 @@
+/*
+Copyright (c) 2018 Daniel Minor
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#ifndef TILE_SCHEDULER_H_
+#define TILE_SCHEDULER_H_
+
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+//a rectangle of pixels from (x0, y0) up to but not including (x1, y1)
+struct Tile {
+    int x0, y0;
+    int x1, y1;
+};
+
+/*
+Hands out image tiles to render threads. Each thread starts with a
+contiguous run of tiles in its own deque which it takes from the front,
+once that is empty it steals from the back of the other threads' deques
+so that no thread sits idle while work remains.
+
+In ordered mode tiles are dealt out in turn and stolen from the front
+instead, so that tiles complete roughly in row order. This keeps the
+number of partially complete rows small when output is streamed.
+*/
+class TileScheduler {
+
+public:
+
+    struct Stats {
+        double busy;        //seconds spent rendering tiles
+        int tiles;          //tiles rendered
+        int stolen;         //tiles taken from other threads
+    };
+
+    /**
+        \param width The width of the image.
+        \param height The height of the image.
+        \param tile_size The width and height of a tile, tiles on the right
+                         and bottom edges are clipped to the image.
+        \param nthreads The number of threads which will call next().
+        \param ordered Whether tiles should complete in row order.
+    */
+    TileScheduler(int width, int height, int tile_size, int nthreads,
+        bool ordered = false)
+        : ordered(ordered), queues(nthreads), threads(nthreads)
+    {
+        for (int y = 0; y < height; y += tile_size) {
+            for (int x = 0; x < width; x += tile_size) {
+                tiles.push_back({x, y, std::min(x + tile_size, width),
+                    std::min(y + tile_size, height)});
+            }
+        }
+
+        for (auto& thread : threads) {
+            thread.stats = {0.0, 0, 0};
+        }
+
+        reset();
+    }
+
+    /**
+        Deals every tile out again for another pass over the image. Stats
+        accumulate across passes. Must not be called while any thread is in
+        next().
+    */
+    void reset()
+    {
+        for (auto& queue : queues) {
+            queue.tiles.clear();
+        }
+
+        //neighbouring tiles go to the same thread for coherence unless
+        //they must complete in order
+        size_t nthreads = queues.size();
+        for (size_t i = 0; i < tiles.size(); ++i) {
+            size_t queue = ordered ? i % nthreads : i*nthreads/tiles.size();
+            queues[queue].tiles.push_back(tiles[i]);
+        }
+
+        //a thread which stopped early is not busy between passes
+        for (auto& thread : threads) {
+            thread.working = false;
+        }
+    }
+
+    /**
+        Gets the next tile for a thread, the time since the previous call is
+        counted as busy.
+
+        \param thread The index of the calling thread.
+        \param tile Set to the tile to render.
+        \return False once every tile has been handed out.
+    */
+    bool next(int thread, Tile &tile)
+    {
+        ThreadState &state = threads[thread];
+        if (state.working) {
+            state.stats.busy += seconds(state.start, Clock::now());
+            state.working = false;
+        }
+
+        bool found = pop_front(queues[thread], tile);
+        for (size_t i = 1; !found && i < queues.size(); ++i) {
+            Queue &victim = queues[(thread + i) % queues.size()];
+            found = ordered ? pop_front(victim, tile) : pop_back(victim, tile);
+            if (found) ++state.stats.stolen;
+        }
+
+        if (found) {
+            ++state.stats.tiles;
+            state.working = true;
+            state.start = Clock::now();
+        }
+
+        return found;
+    }
+
+    //only valid while no thread is in next()
+    const Stats &stats(int thread) const
+    {
+        return threads[thread].stats;
+    }
+
+private:
+
+    typedef std::chrono::steady_clock Clock;
+
+    struct Queue {
+        std::mutex mutex;
+        std::deque<Tile> tiles;
+    };
+
+    //each thread updates its own state, aligned to avoid false sharing
+    struct alignas(64) ThreadState {
+        Stats stats;
+        bool working;
+        Clock::time_point start;
+    };
+
+    bool ordered;
+    std::vector<Tile> tiles;
+    std::vector<Queue> queues;
+    std::vector<ThreadState> threads;
+
+    static double seconds(Clock::time_point start, Clock::time_point end)
+    {
+        return std::chrono::duration<double>(end - start).count();
+    }
+
+    static bool pop_front(Queue &queue, Tile &tile)
+    {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.tiles.empty()) return false;
+        tile = queue.tiles.front();
+        queue.tiles.pop_front();
+        return true;
+    }
+
+    static bool pop_back(Queue &queue, Tile &tile)
+    {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.tiles.empty()) return false;
+        tile = queue.tiles.back();
+        queue.tiles.pop_back();
+        return true;
+    }
+};
+
+#endif
@@ -24,6 +24,7 @@ THE SOFTWARE.
 #define TRANSFORM_H_
 
 #include <limits>
+#include <memory>
 #include <vector>
 
 #include "intersectable.h"
@@ -34,18 +35,88 @@ struct Transform : public Intersectable {
     Vec translation;
     Quat rotation;
 
-    Intersectable *child;
+    //the child may be shared by many transforms, e.g. a mesh instanced
+    //throughout a scene, in which case its bvh is also shared
+    std::shared_ptr<Intersectable> child;
 
     virtual ~Transform() {};
 
-    virtual bool intersect(const Ray &ray, double tmin, double tmax,
-        Vec &pt, Vec &norm, Material *&mat) const
+    virtual bool bounds(BoundingBox &box) const
+    {
+        BoundingBox child_box;
+        if (!child->bounds(child_box)) return false;
+
+        //bound the transformed corners of the child's box
+        Quat conj_rotation = rotation.conjugate();
+        box = BoundingBox();
+        for (int i = 0; i < 8; ++i) {
+            box.expand((rotation*child_box.corner(i)*conj_rotation).v + translation);
+        }
+
+        return true;
+    }
+
+    virtual bool intersect(const Ray &ray, double tmin, Hit &hit) const
+    {
+        Ray r = ray;
+        to_local(r);
+        if (!child->intersect(r, tmin, hit)) return false;
+
+        //record the path to the primitive so that surface() can be
+        //computed in its frame, the scene rejects nesting deeper than a hit
+        //can record
+        if (hit.ninstances < Hit::MAX_INSTANCES) {
+            hit.instances[hit.ninstances++] = this;
+        }
+        return true;
+    }
+
+    virtual void to_local(Ray &ray) const
+    {
+        Quat conj_rotation = rotation.conjugate();
+        ray.origin = (conj_rotation*(ray.origin - translation)*rotation).v;
+        ray.direction = (conj_rotation*ray.direction*rotation).v;
+    }
+
+    virtual void to_world(Vec &pt, Vec &norm, Material *&mat) const
     {
-        Ray r;
         Quat conj_rotation = rotation.conjugate();
-        r.origin = (conj_rotation*(ray.origin - translation)*rotation).v;
-        r.direction = (conj_rotation*ray.direction*rotation).v;
-        return child->intersect(r, tmin, tmax, pt, norm, mat);
+        pt = (rotation*pt*conj_rotation).v + translation;
+        norm = (rotation*norm*conj_rotation).v;
+
+        //a material on the transform overrides that of the child
+        if (material) mat = material.get();
+    }
+
+    virtual bool occluded(const Ray &ray, double tmin, double tmax) const
+    {
+        Ray r = ray;
+        to_local(r);
+        return child->occluded(r, tmin, tmax);
+    }
+
+    virtual unsigned intersect_packet(const RayPacket &packet, unsigned active,
+        double tmin, Hit *hits) const
+    {
+        RayPacket local;
+        for (int i = 0; i < RayPacket::SIZE; ++i) {
+            if (!(active & (1u << i))) continue;
+
+            local.rays[i] = packet.rays[i];
+            to_local(local.rays[i]);
+        }
+
+        unsigned result = child->intersect_packet(local, active, tmin, hits);
+
+        for (int i = 0; i < RayPacket::SIZE; ++i) {
+            if (!(result & (1u << i))) continue;
+
+            if (hits[i].ninstances < Hit::MAX_INSTANCES) {
+                hits[i].instances[hits[i].ninstances++] = this;
+            }
+        }
+
+        return result;
     }
 };
 
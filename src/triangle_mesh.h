@@ -23,8 +23,11 @@ THE SOFTWARE.
 #ifndef TRIANGLE_MESH_H_
 #define TRIANGLE_MESH_H_
 
+#include <algorithm>
+#include <cmath>
 #include <limits>
 
+#include "bvh.h"
 #include "intersectable.h"
 #include "sphere.h"
 
@@ -41,36 +44,171 @@ struct TriangleMesh : public Intersectable {
     std::vector<Vec> vertices;
     std::vector<Face> faces;
 
-    virtual bool intersect(const Ray &ray, double tmin, double tmax,
-        Vec &pt, Vec &norm, Material *&mat) const
+    //acceleration structure over faces
+    BVH bvh;
+
+    //running total of face areas, used to choose faces for emission
+    std::vector<double> area_sums;
+
+    //must be called once vertices and faces are set, width is the number
+    //of children per bvh node
+    void build_bvh(size_t width = 2)
     {
-        bool hit = false;
-        double closest_distance = std::numeric_limits<double>::max();
+        std::vector<BoundingBox> boxes(faces.size());
+        area_sums.resize(faces.size());
+        double area = 0.0;
+        for (size_t i = 0; i < faces.size(); ++i) {
+            const Vec &A = vertices[faces[i].i];
+            const Vec &B = vertices[faces[i].j];
+            const Vec &C = vertices[faces[i].k];
+            boxes[i].expand(A);
+            boxes[i].expand(B);
+            boxes[i].expand(C);
+
+            area += 0.5*(B - A).cross(C - A).magnitude();
+            area_sums[i] = area;
+        }
 
+        bvh.build(boxes, width);
+    }
+
+    virtual double emitting_area() const
+    {
+        return area_sums.empty() ? 0.0 : 2.0*area_sums.back();
+    }
+
+    virtual bool emit(Sampler &sampler, Ray &ray) const
+    {
+        if (area_sums.empty() || area_sums.back() <= 0.0) return false;
+
+        //faces are chosen in proportion to their area
+        double area = sampler.get(Sampler::bounce_dimension(0,
+            Sampler::LIGHT_CHOICE))*area_sums.back();
+        size_t index = std::upper_bound(area_sums.begin(), area_sums.end(),
+            area) - area_sums.begin();
+        if (index == faces.size()) --index;
+        const Face &face = faces[index];
+
+        //uniform point on the triangle
+        double u1, u2;
+        sampler.get_2d(Sampler::PIXEL_X, u1, u2);
+        double s = sqrt(u1);
+        double beta = s*(1.0 - u2);
+        double gamma = s*u2;
+        const Vec &A = vertices[face.i];
+        Vec pt = A + (vertices[face.j] - A)*beta + (vertices[face.k] - A)*gamma;
+
+        //diffuse materials shade both sides of a face, so both sides emit
+        Vec n = face.normal;
+        n.normalize();
+        if (sampler.get(Sampler::bounce_dimension(0,
+                Sampler::COMPONENT_CHOICE)) < 0.5) {
+            n = -n;
+        }
+
+        ray = Ray(0, pt, emit_direction(sampler, n));
+        return true;
+    }
+
+    virtual bool bounds(BoundingBox &box) const
+    {
+        box = BoundingBox();
         for (auto& face : faces) {
-            Vec temp_pt;
-            Vec temp_norm;
-            if (intersect_face(ray, tmin, tmax, face, temp_pt, temp_norm)) {
-                hit = true;
-
-                Vec dist_vec = temp_pt - ray.origin;
-                double distance = dist_vec.dot(dist_vec);
-                if (distance < closest_distance) {
-                    closest_distance = distance;
-                    pt = temp_pt;
-                    norm = temp_norm;
-                    mat = material.get();
-                }
+            box.expand(vertices[face.i]);
+            box.expand(vertices[face.j]);
+            box.expand(vertices[face.k]);
+        }
+        return true;
+    }
+
+    virtual bool intersect(const Ray &ray, double tmin, Hit &hit) const
+    {
+        //each hit shrinks hit.t, so the last hit reported is the closest
+        auto fn = [&](size_t index, double tmin, double &tmax) {
+            double t, beta, gamma;
+            if (intersect_face(ray, tmin, hit.t, faces[index], t, beta, gamma)) {
+                hit.set(t, this, index, beta, gamma);
+                return true;
+            }
+            return false;
+        };
+
+        if (bvh.empty()) {
+            bool result = false;
+            for (size_t i = 0; i < faces.size(); ++i) {
+                if (fn(i, tmin, hit.t)) result = true;
             }
+            return result;
         }
-        if (hit) norm.normalize();
-        return hit;
+
+        return bvh.intersect(ray, tmin, hit.t, fn);
+    }
+
+    virtual void surface(const Ray &ray, const Hit &hit, Vec &pt, Vec &norm,
+        Material *&mat) const
+    {
+        const Face &face = faces[hit.id];
+        const Vec &A = vertices[face.i];
+        pt = A + (A - vertices[face.j])*-hit.u + (A - vertices[face.k])*-hit.v;
+        norm = face.normal;
+        norm.normalize();
+        mat = material.get();
+    }
+
+    virtual bool occluded(const Ray &ray, double tmin, double tmax) const
+    {
+        auto fn = [&](size_t index, double tmin, double tmax) {
+            double t, beta, gamma;
+            return intersect_face(ray, tmin, tmax, faces[index], t, beta, gamma);
+        };
+
+        if (bvh.empty()) {
+            for (size_t i = 0; i < faces.size(); ++i) {
+                if (fn(i, tmin, tmax)) return true;
+            }
+            return false;
+        }
+
+        return bvh.occluded(ray, tmin, tmax, fn);
+    }
+
+    virtual unsigned intersect_packet(const RayPacket &packet, unsigned active,
+        double tmin, Hit *hits) const
+    {
+        if (bvh.empty()) {
+            return Intersectable::intersect_packet(packet, active, tmin, hits);
+        }
+
+        double tmax[RayPacket::SIZE];
+        for (int i = 0; i < RayPacket::SIZE; ++i) {
+            tmax[i] = hits[i].t;
+        }
+
+        auto fn = [&](size_t index, unsigned mask, double tmin, double *tmax) {
+            unsigned result = 0;
+            for (int i = 0; i < RayPacket::SIZE; ++i) {
+                if (!(mask & (1u << i))) continue;
+
+                double t, beta, gamma;
+                if (intersect_face(packet.rays[i], tmin, tmax[i], faces[index],
+                        t, beta, gamma)) {
+                    hits[i].set(t, this, index, beta, gamma);
+                    tmax[i] = t;
+                    result |= 1u << i;
+                }
+            }
+            return result;
+        };
+
+        return bvh.intersect_packet(packet, active, tmin, tmax, fn);
     }
 
     // From Shirley, P. et al (2009) Fundamentals of Computer Graphics, 3rd edition
     // A K Peters, Nattick, MA, pp. 77 - 80
-    virtual bool intersect_face(const Ray &ray, double tmin, double tmax,
-        const Face &face, Vec &pt, Vec &norm) const
+    // Returns the distance t along the ray and the barycentric coordinates
+    // beta and gamma of the hit relative to vertices j and k.
+    bool intersect_face(const Ray &ray, double tmin, double tmax,
+        const Face &face, double &t, double &beta, double &gamma) const
     {
         const Vec &A = vertices[face.i];
         const Vec &B = vertices[face.j];
@@ -82,31 +220,28 @@ struct TriangleMesh : public Intersectable {
 
         double M = ab.x*(ac.y*ray.direction.z - ray.direction.y*ac.z) +
                    ab.y*(ray.direction.x*ac.z - ac.x*ray.direction.z) +
-                   ac.z*(ac.x*ray.direction.y - ac.y*ray.direction.x);
-        double t = (ac.z*(ab.x*ao.y - ao.x*ab.y) +
-                    ac.y*(ao.x*ab.z - ab.x*ao.z) +
-                    ac.x*(ab.y*ao.z - ao.y*ab.y))/-M;
+                   ab.z*(ac.x*ray.direction.y - ac.y*ray.direction.x);
+        t = (ac.z*(ab.x*ao.y - ao.x*ab.y) +
+             ac.y*(ao.x*ab.z - ab.x*ao.z) +
+             ac.x*(ab.y*ao.z - ao.y*ab.z))/-M;
         if (t < tmin || t > tmax) {
             return false;
         }
 
-        double gamma = (ray.direction.z*(ab.x*ao.y - ao.x*ab.y) +
-                        ray.direction.y*(ao.x*ab.z - ab.x*ao.z) +
-                        ray.direction.x*(ab.y*ao.z - ao.y*ab.z))/M;
+        gamma = (ray.direction.z*(ab.x*ao.y - ao.x*ab.y) +
+                 ray.direction.y*(ao.x*ab.z - ab.x*ao.z) +
+                 ray.direction.x*(ab.y*ao.z - ao.y*ab.z))/M;
         if (gamma < 0 || gamma > 1) {
             return false;
         }
 
-        double beta = (ao.x*(ac.y*ray.direction.z - ray.direction.y*ac.z) +
-                       ao.y*(ray.direction.x*ac.z - ac.x*ray.direction.z) +
-                       ao.z*(ac.x*ray.direction.y - ac.y*ray.direction.x))/M;
+        beta = (ao.x*(ac.y*ray.direction.z - ray.direction.y*ac.z) +
+                ao.y*(ray.direction.x*ac.z - ac.x*ray.direction.z) +
+                ao.z*(ac.x*ray.direction.y - ac.y*ray.direction.x))/M;
         if (beta < 0 || beta > (1 - gamma)) {
             return false;
         }
 
-        pt = A + ab*-beta + ac*-gamma;
-        norm = face.normal;
-
         return true;
    }
 };
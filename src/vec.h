@@ -46,13 +46,11 @@ struct Vec {
     {
     }
 
-    static Vec sample_hemisphere()
+    //the sample_ functions map uniform values u1, u2 in [0, 1) to directions
+    static Vec sample_hemisphere(double u1, double u2)
     {
         Vec result;
 
-        double u1 = (double)rand()/(double)RAND_MAX;
-        double u2 = (double)rand()/(double)RAND_MAX;
-
         result.x = cos(2*pi*u2)*2*sqrt(1.0 - u1*u1);
         result.y = sin(2*pi*u2)*2*sqrt(1.0 - u1*u1);
         result.z = u1;
@@ -60,13 +58,10 @@ struct Vec {
         return result;
     }
 
-    static Vec sample_sphere()
+    static Vec sample_sphere(double u1, double u2)
     {
         Vec result;
 
-        double u1 = (double)rand()/(double)RAND_MAX;
-        double u2 = (double)rand()/(double)RAND_MAX;
-
         result.x = cos(2*pi*u2)*2*sqrt(u1*(1.0 - u1));
         result.y = sin(2*pi*u2)*2*sqrt(u1*(1.0 - u1));
         result.z = 1.0 - 2.0*u1;
@@ -74,11 +69,9 @@ struct Vec {
         return result;
     }
 
-    static Vec sample_hemisphere_cosine_weighted()
+    static Vec sample_hemisphere_cosine_weighted(double u1, double u2)
     {
         Vec result;
-        double u1 = (double)rand()/(double)RAND_MAX;
-        double u2 = (double)rand()/(double)RAND_MAX;
 
         double th = 2*pi*u2;
         double r = sqrt(u1);
@@ -89,8 +82,8 @@ struct Vec {
         else result.z = sqrt(result.z);
 
         /*
-        double r1 = (double)rand()/(double)RAND_MAX;
-        double r2 = (double)rand()/(double)RAND_MAX;
+        double r1 = u1;
+        double r2 = u2;
         double cos_theta = sqrt(1.0 - r1);
         double sin_theta = sqrt(1.0 - cos_theta*cos_theta);
         double phi = 2.0*pi*r2;